@@ -0,0 +1,64 @@
+/*
+ * cachehook.c - ThreadSanitizer hooks that simulate instead (see cachehook.h)
+ *
+ * gcc instruments a load of n bytes as a call to __tsan_readn(addr) and a
+ * store as __tsan_writen(addr), with _unaligned_ variants and _range ones
+ * for vector accesses and block copies. Each becomes one L or S access of
+ * the attached cache, of its full size at its start address.
+ * The function entry and exit hooks have nothing to do.
+ */
+#include "cachehook.h"
+
+int cachehook_instrumented = 0;
+
+/* The cache being fed, NULL for none */
+static cache_t *hook_cache = NULL;
+
+void cachehook_attach(cache_t *cache)
+{
+    hook_cache = cache;
+}
+
+static void hook(char op, void *addr, int size)
+{
+    if (hook_cache)
+        cache_simulate(hook_cache, op, (unsigned long long)addr, size);
+}
+
+/* Called by the constructor of every instrumented object */
+void __tsan_init(void)
+{
+    cachehook_instrumented = 1;
+}
+
+void __tsan_func_entry(void *pc) {}
+void __tsan_func_exit(void) {}
+
+#define DEFINE_HOOKS(n)                                                 \
+    void __tsan_read##n(void *addr) { hook('L', addr, n); }             \
+    void __tsan_write##n(void *addr) { hook('S', addr, n); }            \
+    void __tsan_unaligned_read##n(void *addr) { hook('L', addr, n); }   \
+    void __tsan_unaligned_write##n(void *addr) { hook('S', addr, n); }
+
+DEFINE_HOOKS(1)
+DEFINE_HOOKS(2)
+DEFINE_HOOKS(4)
+DEFINE_HOOKS(8)
+DEFINE_HOOKS(16)
+
+/* A range access (a vector load or store, or a block copy) is one
+   access at its start, as lackey records it */
+static void hook_range(char op, void *addr, unsigned long size)
+{
+    hook(op, addr, (int)size);
+}
+
+void __tsan_read_range(void *addr, unsigned long size)
+{
+    hook_range('L', addr, size);
+}
+
+void __tsan_write_range(void *addr, unsigned long size)
+{
+    hook_range('S', addr, size);
+}
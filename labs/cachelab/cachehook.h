@@ -0,0 +1,26 @@
+/*
+ * cachehook.h - Simulating the memory accesses of instrumented code
+ *
+ * Code compiled with gcc -fsanitize=thread calls a hook before each of
+ * its loads and stores (__tsan_read4(addr), __tsan_write8(addr), ...).
+ * cachehook.c defines those hooks, without the ThreadSanitizer runtime,
+ * to feed every access straight into a cachesim cache. Linking trans.c
+ * compiled that way against cachehook.c gives its exact load and store
+ * stream, as valgrind's lackey would record it, at native speed.
+ *
+ * Only the instrumented objects call the hooks. Locals that live in
+ * registers are never hooked; the stack accesses that -O0 code still
+ * makes for them are, as valgrind sees them, not part of the trace.
+ */
+#ifndef CACHEHOOK_H
+#define CACHEHOOK_H
+
+#include "cachesim.h"
+
+/* Set once an instrumented object has been loaded */
+extern int cachehook_instrumented;
+
+/* Send the hooked accesses from now on to cache, or nowhere if NULL */
+void cachehook_attach(cache_t *cache);
+
+#endif /* CACHEHOOK_H */
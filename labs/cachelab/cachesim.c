@@ -0,0 +1,755 @@
+/*
+ * cachesim.c - The Cache Lab cache model as a library (see cachesim.h)
+ *
+ * Everything a simulation needs lives in its cache_t: the lines, the
+ * replacement state, the prefetcher and the counters. There is no global
+ * state, so any number of caches can be simulated side by side, from any
+ * number of threads, one thread per cache.
+ */
+#include "cachesim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Tag search kernels
+ *
+ * A tag search compares the tag of an access against every line of a set
+ * and returns the matching valid line, or -1 on a miss. The SIMD kernels
+ * compare 4 (AVX2) or 2 (SSE4.1) 64-bit tags per instruction, squash the
+ * result into a bit mask with movemask, AND it with a mask of the valid
+ * bytes, and bit-scan for the match. Each kernel is compiled for its
+ * instruction set with a target attribute, and cache_init picks one at
+ * runtime from what the CPU supports.
+ */
+
+static int tag_search_scalar(const unsigned long long* tags, const unsigned char* valid,
+                             int E, unsigned long long tag) {
+  for (int i = 0; i < E; i++) {
+    if (valid[i] && tags[i] == tag) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static int
+tag_search_avx2(const unsigned long long* tags, const unsigned char* valid, int E,
+                unsigned long long tag) {
+  __m256i key = _mm256_set1_epi64x((long long)tag);
+  __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  // 8 lines per iteration: two tag compares and one load of 8 valid bytes
+  for (; i + 8 <= E; i += 8) {
+    __m256i lo = _mm256_loadu_si256((const __m256i*)(tags + i));
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(tags + i + 4));
+    unsigned int match =
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(lo, key))) |
+        _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(hi, key))) << 4;
+    __m128i v = _mm_loadl_epi64((const __m128i*)(valid + i));
+    match &= ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xff;
+    if (match) {
+      return i + __builtin_ctz(match);
+    }
+  }
+  int j = tag_search_scalar(tags + i, valid + i, E - i, tag);
+  return (j < 0) ? -1 : i + j;
+}
+
+__attribute__((target("sse4.1"))) static int
+tag_search_sse41(const unsigned long long* tags, const unsigned char* valid, int E,
+                 unsigned long long tag) {
+  __m128i key = _mm_set1_epi64x((long long)tag);
+  __m128i zero = _mm_setzero_si128();
+  int i = 0;
+  // 4 lines per iteration: two tag compares and one load of 4 valid bytes
+  for (; i + 4 <= E; i += 4) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(tags + i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(tags + i + 2));
+    unsigned int match = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(lo, key))) |
+                         _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(hi, key))) << 2;
+    int v4;
+    memcpy(&v4, valid + i, sizeof(v4));
+    match &= ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_cvtsi32_si128(v4), zero)) & 0xf;
+    if (match) {
+      return i + __builtin_ctz(match);
+    }
+  }
+  int j = tag_search_scalar(tags + i, valid + i, E - i, tag);
+  return (j < 0) ? -1 : i + j;
+}
+#endif
+
+// pick a tag search kernel: the named one, or with no name the widest the
+// CPU runs; NULL for a name that is unknown or that the CPU cannot run
+tag_search_t tag_search_select(const char* name, const char** chosen) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if ((name == NULL || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+    *chosen = "avx2";
+    return tag_search_avx2;
+  }
+  if ((name == NULL || strcmp(name, "sse4.1") == 0) && __builtin_cpu_supports("sse4.1")) {
+    *chosen = "sse4.1";
+    return tag_search_sse41;
+  }
+#endif
+  if (name != NULL && strcmp(name, "scalar") != 0) {
+    return NULL;
+  }
+  *chosen = "scalar";
+  return tag_search_scalar;
+}
+
+/**
+ * Replacement policies
+ *
+ *   lru      least recently used (per-set recency list)
+ *   fifo     oldest fill first (per-set round-robin hand)
+ *   random   uniformly random line (xorshift)
+ *   plru     tree pseudo-LRU: one bit per node of a binary tree over the
+ *            ways points away from the most recent access (E a power of 2)
+ *   bitplru  bit pseudo-LRU: one MRU bit per way, cleared for every other
+ *            way when all are set; the victim is the first clear way
+ *   srrip    static re-reference interval prediction (Jaleel et al. 2010):
+ *            2-bit RRPV per line, fill at 2, hit resets to 0, the victim
+ *            is a line at 3 (ageing every line until one gets there)
+ *   brrip    bimodal RRIP: like srrip but fills at 3, and at 2 only once
+ *            in BRRIP_EPSILON fills, so streams do not flush the set
+ *
+ * Every policy fills invalid lines before it evicts anything. The policy
+ * is a compile-time constant in each specialized replay loop below, so
+ * the per-access code carries no policy dispatch at all.
+ */
+const char* const policy_names[NUM_POLICIES] = {"lru",     "fifo",  "random", "plru",
+                                                "bitplru", "srrip", "brrip"};
+
+// the policy called name, or -1
+int policy_parse(const char* name) {
+  for (int policy = 0; policy < NUM_POLICIES; policy++) {
+    if (strcmp(name, policy_names[policy]) == 0) {
+      return policy;
+    }
+  }
+  return -1;
+}
+
+// whether policy can manage sets of E lines
+int policy_supports(int policy, int E) {
+  if (policy == TREE_PLRU) {
+    return E <= 64 && (E & (E - 1)) == 0;
+  }
+  return policy != BIT_PLRU || E <= 64;
+}
+
+#define RRPV_MAX 3       // 2-bit re-reference prediction values
+#define BRRIP_EPSILON 32 // brrip fills 1 in this many lines at RRPV_MAX - 1
+
+// put every line, policy state and counter back as cache_init left them
+static void cache_clear(cache_t* cache) {
+  // zero lines are invalid with tag 0
+  memset(cache->mem, 0, cache->mem_size);
+  // every recency list starts out as 0, 1, ..., E-1
+  int E = cache->E;
+  for (size_t k = 0; k < (size_t)cache->S; k++) {
+    for (int i = 0; i < E; i++) {
+      cache->prev[k * E + i] = i - 1; // unused for the mru line
+      cache->next[k * E + i] = i + 1; // unused for the lru line
+    }
+    cache->mru[k] = 0;
+    cache->lru[k] = E - 1;
+  }
+  cache->rng = 88172645463325252ULL;
+  cache->pc = 0;
+  cache->hits = cache->misses = cache->evictions = 0;
+  cache->prefetches = cache->prefetch_hits = 0;
+  cache->useless_prefetches = cache->pollution = 0;
+}
+
+// init the full cache; kernel names the tag search kernel, NULL for the fastest
+cache_t* cache_init(int s, int E, int b, const char* kernel, int policy) {
+  // s + b bits must leave room in a 64 bit address for the tag
+  if (s < 0 || s > 30 || E <= 0 || b < 0 || s + b > 63 || policy < 0 ||
+      policy >= NUM_POLICIES || !policy_supports(policy, E)) {
+    return NULL;
+  }
+  cache_t* cache = malloc(sizeof(cache_t));
+  if (cache == NULL)
+    return NULL;
+
+  // Calculate S and B
+  cache->S = 1 << s; // 2^s sets
+  cache->E = E;
+  cache->B = 1 << b; // 2^b bytes per block
+  cache->s = s;
+  cache->b = b;
+
+  // one allocation for every array, each aligned to a host cache line
+  size_t lines = (size_t)cache->S * E;
+  size_t tags_size = ALIGN_UP(lines * sizeof(unsigned long long));
+  size_t valid_size = ALIGN_UP(lines * sizeof(unsigned char));
+  size_t link_size = ALIGN_UP(lines * sizeof(unsigned int));
+  size_t end_size = ALIGN_UP(cache->S * sizeof(unsigned int));
+  size_t bits_size = ALIGN_UP(cache->S * sizeof(unsigned long long));
+  cache->mem_size =
+      tags_size + 4 * valid_size + 2 * link_size + 3 * end_size + bits_size + CACHE_ALIGN;
+  cache->mem = malloc(cache->mem_size);
+  if (cache->mem == NULL) {
+    free(cache);
+    return NULL;
+  }
+  char* base = (char*)ALIGN_UP((size_t)cache->mem);
+  cache->tags = (unsigned long long*)base;
+  cache->valid = (unsigned char*)(base += tags_size);
+  cache->dirty = (unsigned char*)(base += valid_size);
+  cache->prev = (unsigned int*)(base += valid_size);
+  cache->next = (unsigned int*)(base += link_size);
+  cache->mru = (unsigned int*)(base += link_size);
+  cache->lru = (unsigned int*)(base += end_size);
+  cache->fill = (unsigned int*)(base += end_size);
+  cache->rrpv = (unsigned char*)(base += end_size);
+  cache->bits = (unsigned long long*)(base += valid_size);
+  cache->prefetched = (unsigned char*)(base += bits_size);
+  cache->policy = policy;
+  cache->verbose = 0;
+  cache->search = tag_search_select(kernel, &cache->search_name);
+  if (cache->search == NULL) {
+    free(cache->mem);
+    free(cache);
+    return NULL;
+  }
+  cache->prefetcher = NULL;
+  cache_clear(cache);
+  return cache;
+}
+
+// free the full cache
+void cache_free(cache_t* cache) {
+  free(cache->prefetcher);
+  free(cache->mem);
+  free(cache);
+}
+
+// copy the counters of the cache
+void cache_stats(const cache_t* cache, cache_stats_t* stats) {
+  stats->hits = cache->hits;
+  stats->misses = cache->misses;
+  stats->evictions = cache->evictions;
+  stats->prefetches = cache->prefetches;
+  stats->prefetch_hits = cache->prefetch_hits;
+  stats->useless_prefetches = cache->useless_prefetches;
+  stats->pollution = cache->pollution;
+}
+
+// make line i the most recently used line of set k
+void cache_touch(cache_t* cache, size_t k, unsigned int i) {
+  unsigned int head = cache->mru[k];
+  if (head == i) {
+    return;
+  }
+  unsigned int* prev = cache->prev + k * cache->E;
+  unsigned int* next = cache->next + k * cache->E;
+  // unlink i; it has a predecessor since it is not the head
+  next[prev[i]] = next[i];
+  if (cache->lru[k] == i) {
+    cache->lru[k] = prev[i];
+  } else {
+    prev[next[i]] = prev[i];
+  }
+  // and push it on the front
+  next[i] = head;
+  prev[head] = i;
+  cache->mru[k] = i;
+}
+
+// make line i the least recently used line of set k, so that it is the next
+// victim (used for lines that were just invalidated)
+void cache_demote(cache_t* cache, size_t k, unsigned int i) {
+  unsigned int tail = cache->lru[k];
+  if (tail == i) {
+    return;
+  }
+  unsigned int* prev = cache->prev + k * cache->E;
+  unsigned int* next = cache->next + k * cache->E;
+  // unlink i; it has a successor since it is not the tail
+  if (cache->mru[k] == i) {
+    cache->mru[k] = next[i];
+  } else {
+    next[prev[i]] = next[i];
+  }
+  prev[next[i]] = prev[i];
+  // and append it at the back
+  prev[i] = tail;
+  next[tail] = i;
+  cache->lru[k] = i;
+}
+
+// next number of the cache's xorshift generator
+static inline unsigned long long cache_random(cache_t* cache) {
+  cache->rng ^= cache->rng << 13;
+  cache->rng ^= cache->rng >> 7;
+  cache->rng ^= cache->rng << 17;
+  return cache->rng;
+}
+
+// record a use (hit or fill) of line i of set k under policy P
+static inline __attribute__((always_inline)) void policy_touch(cache_t* cache, size_t k,
+                                                               unsigned int i, int fill,
+                                                               const int P) {
+  switch (P) {
+  case LRU:
+    cache_touch(cache, k, i);
+    break;
+  case TREE_PLRU: {
+    // walk from the root to leaf i, pointing every node the other way
+    unsigned long long bits = cache->bits[k];
+    unsigned int node = 1;
+    for (unsigned int half = cache->E >> 1; half > 0; half >>= 1) {
+      int right = (i & half) != 0;
+      bits = right ? bits & ~(1ULL << node) : bits | (1ULL << node);
+      node = 2 * node + right;
+    }
+    cache->bits[k] = bits;
+    break;
+  }
+  case BIT_PLRU: {
+    unsigned long long all = (cache->E == 64) ? ~0ULL : (1ULL << cache->E) - 1;
+    unsigned long long bits = cache->bits[k] | (1ULL << i);
+    cache->bits[k] = (bits == all) ? (1ULL << i) : bits;
+    break;
+  }
+  case SRRIP:
+  case BRRIP:
+    if (!fill) {
+      cache->rrpv[k * cache->E + i] = 0;
+    } else if (P == SRRIP || cache_random(cache) % BRRIP_EPSILON == 0) {
+      cache->rrpv[k * cache->E + i] = RRPV_MAX - 1;
+    } else {
+      cache->rrpv[k * cache->E + i] = RRPV_MAX;
+    }
+    break;
+  default: // fifo and random ignore hits
+    break;
+  }
+}
+
+// the line of set k to fill next under policy P; *evict is set if it is valid
+static inline __attribute__((always_inline)) unsigned int
+policy_victim(cache_t* cache, size_t k, int* evict, const int P) {
+  unsigned int E = cache->E;
+  if (P == LRU) {
+    // invalid lines sit at the back of the list, so this covers them too
+    unsigned int victim = cache->lru[k];
+    *evict = cache->valid[k * E + victim];
+    return victim;
+  }
+  if (P == FIFO) {
+    // lines are filled in order, so the hand also walks the invalid ones
+    unsigned int victim = cache->fill[k];
+    cache->fill[k] = (victim + 1 == E) ? 0 : victim + 1;
+    *evict = cache->valid[k * E + victim];
+    return victim;
+  }
+  // nothing is ever invalidated here, so the first fill[k] lines are valid
+  if (cache->fill[k] < E) {
+    *evict = 0;
+    return cache->fill[k]++;
+  }
+  *evict = 1;
+  switch (P) {
+  case RANDOM:
+    return cache_random(cache) % E;
+  case TREE_PLRU: {
+    // follow the node bits from the root down to the pseudo-LRU leaf
+    unsigned long long bits = cache->bits[k];
+    unsigned int node = 1, victim = 0;
+    for (unsigned int half = E >> 1; half > 0; half >>= 1) {
+      int right = (bits >> node) & 1;
+      victim |= right ? half : 0;
+      node = 2 * node + right;
+    }
+    return victim;
+  }
+  case BIT_PLRU:
+    // touching never leaves every bit set, except in a 1-way set
+    return (E == 1) ? 0 : __builtin_ctzll(~cache->bits[k]);
+  default: { // SRRIP, BRRIP
+    unsigned char* rrpv = cache->rrpv + k * E;
+    for (;;) {
+      for (unsigned int i = 0; i < E; i++) {
+        if (rrpv[i] == RRPV_MAX) {
+          return i;
+        }
+      }
+      for (unsigned int i = 0; i < E; i++) {
+        rrpv[i]++;
+      }
+    }
+  }
+  }
+}
+
+// Simulate cache behaviour by doing appropriate load and stores, with the
+// replacement policy P fixed at compile time by the caller
+static inline __attribute__((always_inline)) int
+cache_access(cache_t* cache, char operation, unsigned long long address, const int P) {
+  int outcome = HIT;
+
+  // Extract set index and tag from address
+
+  // creates a mask of ones with s bits all set to one. if s is 3, then mask is 0b111
+  unsigned int index_mask = (1 << cache->s) - 1;
+  // shift to right the block offset bits. then take the s bits
+  unsigned int set_index = (address >> cache->b) & index_mask;
+  unsigned long long tag = address >> (cache->s + cache->b);
+  // the lines of this set are [first, first + E) in each array
+  size_t first = (size_t)set_index * cache->E;
+  unsigned long long* tags = cache->tags + first;
+  unsigned char* valid = cache->valid + first;
+
+  if (cache->verbose) {
+    printf(" | requesting set %d, tag %llx | ", set_index, tag);
+  }
+
+  // Search for hit
+  int i = cache->search(tags, valid, cache->E, tag);
+  if (i >= 0) {
+    // successfully hit; let the policy know
+    policy_touch(cache, set_index, i, 0, P);
+    // print if verbose
+    if (cache->verbose) {
+      printf(" hit ");
+    }
+    cache->hits++;
+    // the first use of a prefetched line is what made the prefetch useful
+    if (cache->prefetched[first + i]) {
+      cache->prefetched[first + i] = 0;
+      cache->prefetch_hits++;
+      outcome = PREFETCH_HIT;
+    }
+  } else {
+    outcome = MISS;
+    // Handle miss
+    // print if verbose
+    if (cache->verbose) {
+      printf(" miss ");
+    }
+    cache->misses++;
+    // the policy picks the line to fill: an empty one, or a victim to evict
+    int evict;
+    unsigned int victim = policy_victim(cache, set_index, &evict, P);
+    if (evict) {
+      // print if verbose
+      if (cache->verbose) {
+        printf(" evict ");
+      }
+      cache->evictions++;
+      cache->useless_prefetches += cache->prefetched[first + victim];
+    }
+    valid[victim] = 1;
+    tags[victim] = tag;
+    cache->prefetched[first + victim] = 0;
+    policy_touch(cache, set_index, victim, 1, P);
+  }
+  // Modify operation ('M' means load + store, so always an extra hit)
+  // else its just the same as before
+  if (operation == 'M') {
+    // print if verbose
+    if (cache->verbose) {
+      printf(" hit_m ");
+    }
+    cache->hits++;
+  }
+  return outcome;
+}
+
+/**
+ * Prefetchers
+ *
+ * A prefetcher watches the demand accesses and fills lines it expects to
+ * be used soon. Prefetched lines go in like demand fills, under the same
+ * replacement policy, with a flag that is cleared by their first use:
+ *
+ *   nextline  tagged next-line: a miss, or the first hit on a prefetched
+ *             line, prefetches the next <degree> blocks
+ *   stride    reference prediction table: per load/store PC (the address
+ *             of the last I record; traces without I records share one
+ *             entry) the last address and stride, with a 2-bit confidence
+ *             counter; once confident, prefetch <degree> strides ahead
+ *   stream    up to PF_STREAMS streams of nearby misses; once two misses
+ *             move the same way, prefetch <degree> blocks ahead of the last
+ *
+ * Besides the demand counts we report prefetch hits (first uses of
+ * prefetched lines), useless prefetches (prefetched lines evicted unused)
+ * and pollution (demand lines evicted to make room for a prefetch).
+ */
+enum prefetch_kind { PF_NEXTLINE, PF_STRIDE, PF_STREAM, NUM_PREFETCHERS };
+
+static const char* prefetcher_names[NUM_PREFETCHERS] = {"nextline", "stride", "stream"};
+
+#define PF_DEGREE 1     // blocks (or strides) to run ahead, unless -F says
+#define PF_RPT_SIZE 256 // entries of the stride prefetcher's table
+#define PF_STREAMS 16   // streams the stream prefetcher tracks
+#define PF_WINDOW 16    // blocks a miss may be from a stream to extend it
+
+typedef struct prefetcher {
+  int kind;
+  int degree;
+  // stride: reference prediction table, indexed by a hash of the pc
+  struct {
+    unsigned long long pc;
+    unsigned long long last; // last address
+    long long stride;
+    int confidence;          // 0..3, prefetch from 2 up
+  } rpt[PF_RPT_SIZE];
+  // stream: tracked streams, replaced least recently used first
+  struct {
+    unsigned long long last; // last block
+    int direction;           // +1, -1, or 0 while untrained
+    int confidence;
+    unsigned long used;      // when the stream last moved
+  } streams[PF_STREAMS];
+  unsigned long clock;
+} prefetcher_t;
+
+// parse -F kind[:degree]; returns 0, or -1 if it names no prefetcher
+int prefetcher_parse(const char* spec, int* kind, int* degree) {
+  size_t len = strcspn(spec, ":");
+  for (*kind = 0; *kind < NUM_PREFETCHERS; (*kind)++) {
+    if (strlen(prefetcher_names[*kind]) == len &&
+        strncmp(spec, prefetcher_names[*kind], len) == 0) {
+      break;
+    }
+  }
+  *degree = (spec[len] == ':') ? atoi(spec + len + 1) : PF_DEGREE;
+  return (*kind == NUM_PREFETCHERS || *degree <= 0) ? -1 : 0;
+}
+
+// attach the prefetcher of spec (as for -F) to cache, replacing any it
+// had; returns 0, or -1 if spec names no prefetcher or memory runs out
+int cache_set_prefetcher(cache_t* cache, const char* spec) {
+  int kind, degree;
+  if (prefetcher_parse(spec, &kind, &degree) < 0) {
+    return -1;
+  }
+  prefetcher_t* pf = calloc(1, sizeof(prefetcher_t));
+  if (pf == NULL) {
+    return -1;
+  }
+  pf->kind = kind;
+  pf->degree = degree;
+  free(cache->prefetcher);
+  cache->prefetcher = pf;
+  return 0;
+}
+
+// empty the cache and zero its counters, keeping its geometry, policy and
+// prefetcher
+void cache_reset(cache_t* cache) {
+  cache_clear(cache);
+  if (cache->prefetcher != NULL) {
+    prefetcher_t* pf = cache->prefetcher;
+    int kind = pf->kind, degree = pf->degree;
+    memset(pf, 0, sizeof(*pf));
+    pf->kind = kind;
+    pf->degree = degree;
+  }
+}
+
+
+// fill the block (address >> b) as a prefetch, unless it is cached already
+static inline __attribute__((always_inline)) void
+cache_prefetch(cache_t* cache, unsigned long long block, const int P) {
+  size_t set_index = block & (cache->S - 1);
+  unsigned long long tag = block >> cache->s;
+  size_t first = set_index * cache->E;
+  if (cache->search(cache->tags + first, cache->valid + first, cache->E, tag) >= 0) {
+    return;
+  }
+  cache->prefetches++;
+  int evict;
+  unsigned int victim = policy_victim(cache, set_index, &evict, P);
+  if (evict) {
+    if (cache->prefetched[first + victim]) {
+      cache->useless_prefetches++;
+    } else {
+      cache->pollution++;
+    }
+  }
+  cache->valid[first + victim] = 1;
+  cache->tags[first + victim] = tag;
+  cache->prefetched[first + victim] = 1;
+  policy_touch(cache, set_index, victim, 1, P);
+}
+
+// let the prefetcher see a demand access by the instruction at pc
+static inline __attribute__((always_inline)) void
+prefetch_observe(cache_t* cache, unsigned long long address, unsigned long long pc,
+                 int outcome, const int P) {
+  prefetcher_t* pf = cache->prefetcher;
+  unsigned long long block = address >> cache->b;
+
+  if (pf->kind == PF_STRIDE) {
+    // trains on every access: strides show up in hits as well as misses
+    size_t k = (pc * 0x9E3779B97F4A7C15ULL) >> 56 & (PF_RPT_SIZE - 1);
+    if (pf->rpt[k].pc != pc || pf->rpt[k].last == 0) {
+      pf->rpt[k].pc = pc;
+      pf->rpt[k].stride = 0;
+      pf->rpt[k].confidence = 0;
+    } else {
+      long long stride = (long long)(address - pf->rpt[k].last);
+      if (stride != 0 && stride == pf->rpt[k].stride) {
+        pf->rpt[k].confidence += (pf->rpt[k].confidence < 3);
+      } else if (pf->rpt[k].confidence > 0) {
+        pf->rpt[k].confidence--;
+      } else {
+        pf->rpt[k].stride = stride;
+      }
+    }
+    pf->rpt[k].last = address;
+    if (pf->rpt[k].confidence >= 2) {
+      for (int d = 1; d <= pf->degree; d++) {
+        unsigned long long target = (address + d * pf->rpt[k].stride) >> cache->b;
+        if (target != block) {
+          cache_prefetch(cache, target, P);
+        }
+      }
+    }
+    return;
+  }
+
+  // next-line and stream prefetchers train on misses and first uses only
+  if (outcome == HIT) {
+    return;
+  }
+  if (pf->kind == PF_NEXTLINE) {
+    for (int d = 1; d <= pf->degree; d++) {
+      cache_prefetch(cache, block + d, P);
+    }
+    return;
+  }
+
+  // PF_STREAM: extend the nearest stream, or start a new one
+  int best = -1, lru = 0;
+  unsigned long long best_dist = PF_WINDOW + 1;
+  for (int k = 0; k < PF_STREAMS; k++) {
+    unsigned long long last = pf->streams[k].last;
+    unsigned long long dist = (block > last) ? block - last : last - block;
+    if (pf->streams[k].used != 0 && dist != 0 && dist < best_dist) {
+      best_dist = dist;
+      best = k;
+    }
+    if (pf->streams[k].used < pf->streams[lru].used) {
+      lru = k;
+    }
+  }
+  pf->clock++;
+  if (best < 0) {
+    pf->streams[lru].last = block;
+    pf->streams[lru].direction = 0;
+    pf->streams[lru].confidence = 0;
+    pf->streams[lru].used = pf->clock;
+    return;
+  }
+  int direction = (block > pf->streams[best].last) ? 1 : -1;
+  if (direction == pf->streams[best].direction) {
+    pf->streams[best].confidence += (pf->streams[best].confidence < 3);
+  } else {
+    pf->streams[best].direction = direction;
+    pf->streams[best].confidence = 1;
+  }
+  pf->streams[best].last = block;
+  pf->streams[best].used = pf->clock;
+  if (pf->streams[best].confidence >= 2) {
+    for (int d = 1; d <= pf->degree; d++) {
+      cache_prefetch(cache, block + direction * d, P);
+    }
+  }
+}
+
+/**
+ * Replay loops, one copy per policy
+ *
+ * Each copy inlines cache_access with its policy as a constant, so the
+ * compiler drops every other policy's code from the loop body.
+ */
+typedef int (*replay_one_t)(cache_t*, char, unsigned long long);
+typedef void (*replay_ops_t)(cache_t*, const trace_op_t*, size_t);
+typedef void (*replay_trace_t)(cache_t*, ctrace_reader_t*);
+
+// one access plus, when prefetching, the prefetcher's reaction to it; an
+// I record only becomes the pc of the accesses after it
+static inline __attribute__((always_inline)) int
+replay_access(cache_t* cache, char operation, unsigned long long address, const int P) {
+  if (operation == 'I') {
+    cache->pc = address;
+    return HIT;
+  }
+  int outcome = cache_access(cache, operation, address, P);
+  if (cache->prefetcher != NULL) {
+    prefetch_observe(cache, address, cache->pc, outcome, P);
+  }
+  return outcome;
+}
+
+#define DEFINE_REPLAY(name, P)                                                         \
+  static int replay_one_##name(cache_t* cache, char operation,                        \
+                               unsigned long long address) {                          \
+    return replay_access(cache, operation, address, P);                               \
+  }                                                                                   \
+  static void replay_ops_##name(cache_t* cache, const trace_op_t* ops, size_t n) {    \
+    for (size_t i = 0; i < n; i++) {                                                  \
+      replay_access(cache, ops[i].operation, ops[i].address, P);                      \
+    }                                                                                 \
+  }                                                                                   \
+  static void replay_trace_##name(cache_t* cache, ctrace_reader_t* trace) {           \
+    char operation;                                                                   \
+    unsigned long long address;                                                       \
+    int size;                                                                         \
+    while (ctrace_next(trace, &operation, &address, &size)) {                         \
+      if (cache->verbose) {                                                           \
+        printf("\nOperation: %c, Address: 0x%llx, Value: %d", operation, address, size); \
+      }                                                                               \
+      replay_access(cache, operation, address, P);                                    \
+    }                                                                                 \
+  }
+
+DEFINE_REPLAY(lru, LRU)
+DEFINE_REPLAY(fifo, FIFO)
+DEFINE_REPLAY(random, RANDOM)
+DEFINE_REPLAY(plru, TREE_PLRU)
+DEFINE_REPLAY(bitplru, BIT_PLRU)
+DEFINE_REPLAY(srrip, SRRIP)
+DEFINE_REPLAY(brrip, BRRIP)
+
+// indexed by enum policy
+static const replay_one_t replay_one[NUM_POLICIES] = {
+    replay_one_lru,     replay_one_fifo,  replay_one_random, replay_one_plru,
+    replay_one_bitplru, replay_one_srrip, replay_one_brrip};
+static const replay_ops_t replay_ops[NUM_POLICIES] = {
+    replay_ops_lru,     replay_ops_fifo,  replay_ops_random, replay_ops_plru,
+    replay_ops_bitplru, replay_ops_srrip, replay_ops_brrip};
+static const replay_trace_t replay_trace[NUM_POLICIES] = {
+    replay_trace_lru,     replay_trace_fifo,  replay_trace_random, replay_trace_plru,
+    replay_trace_bitplru, replay_trace_srrip, replay_trace_brrip};
+
+// simulate one access of size bytes; returns its enum outcome
+int cache_simulate(cache_t* cache, char operation, unsigned long long address, int size) {
+  // like csim-ref, an access is taken not to cross into the next block
+  (void)size;
+  return replay_one[cache->policy](cache, operation, address);
+}
+
+// simulate n accesses in order, in the loop specialized for the policy
+void cache_simulate_batch(cache_t* cache, const trace_op_t* ops, size_t n) {
+  replay_ops[cache->policy](cache, ops, n);
+}
+
+// simulate every access of a trace opened with ctrace_open
+void cache_replay(cache_t* cache, ctrace_reader_t* trace) {
+  replay_trace[cache->policy](cache, trace);
+}
@@ -0,0 +1,178 @@
+/*
+ * cachesim.h - The Cache Lab cache model as a library
+ *
+ * A cache_t simulates one cache of 2^s sets of E lines of 2^b bytes under
+ * one replacement policy, optionally with a prefetcher. It keeps its own
+ * hit, miss and eviction counts, so a program can simulate accesses in
+ * process instead of writing a trace and running csim-ref on it:
+ *
+ *   cache_t* cache = cache_init(5, 1, 5, NULL, LRU);
+ *   cache_simulate(cache, 'L', (unsigned long long)&A[i][j], sizeof(int));
+ *   ...
+ *   cache_stats_t stats;
+ *   cache_stats(cache, &stats);
+ *   cache_free(cache);
+ *
+ * Accesses follow valgrind's lackey: L (load) and S (store) are one
+ * access each, M (modify) is a load followed by a store to the same
+ * address, so its store always hits. I (instruction fetch) records do not
+ * touch the data cache; their address becomes the pc that the stride
+ * prefetcher keys its table on.
+ *
+ * The struct is public for the simulator's own modes (hierarchy,
+ * coherence, sharding) that drive the lines directly; other code should
+ * stick to the functions.
+ */
+#ifndef CACHESIM_H
+#define CACHESIM_H
+
+#include <stddef.h>
+#include "cachetrace.h"
+
+/* A tag search kernel: the valid line of tags[0..E) holding tag, or -1 */
+typedef int (*tag_search_t)(const unsigned long long* tags, const unsigned char* valid,
+                            int E, unsigned long long tag);
+
+/* Replacement policies (described in cachesim.c), and their -p names */
+enum policy { LRU, FIFO, RANDOM, TREE_PLRU, BIT_PLRU, SRRIP, BRRIP, NUM_POLICIES };
+
+extern const char* const policy_names[NUM_POLICIES];
+
+/* What a data access found (prefetchers train on misses and first uses) */
+enum outcome { HIT, MISS, PREFETCH_HIT };
+
+// arrays inside the cache allocation start on their own host cache line
+#define CACHE_ALIGN 64
+#define ALIGN_UP(n) (((n) + CACHE_ALIGN - 1) & ~(size_t)(CACHE_ALIGN - 1))
+
+/**
+ * Simulates the full cache
+ *
+ * All lines live in one contiguous allocation, laid out as a structure of
+ * arrays: line i of set k is element k * E + i of each array. Looking up a
+ * set is then a multiply instead of two pointer chases, and a tag search
+ * only touches the tags of that set (E * 8 contiguous bytes), not the
+ * valid flags and LRU state that sit between them in an array of structs.
+ */
+typedef struct cache {
+  int S; // Number of sets (2^s)
+  int E; // Number of lines per set
+  int B; // Block size (2^b)
+  int s; // Set index bits
+  int b; // Block offset bits
+  // tag bits are always 64bit here
+  // unsigned long long guarantees 64 bits on all platforms
+  unsigned long long* tags;
+  // 0 for invalid, 1 for valid; one byte per line instead of an int
+  unsigned char* valid;
+  // 1 if the line was written since it was filled (only the hierarchy
+  // mode models write-back; the single cache ignores it)
+  unsigned char* dirty;
+  // LRU implementation
+  //  each set keeps its lines in a doubly linked recency list, from the
+  //  most recently used line (mru) to the least recently used one (lru)
+  //  prev/next hold line numbers within the set (0..E-1)
+  //  a hit moves the line to the front: O(1) instead of aging every line
+  //  the victim is always the lru line: O(1) instead of a scan for the oldest
+  //  invalid lines start at the back of the list, so they are filled first
+  unsigned int* prev;
+  unsigned int* next;
+  unsigned int* mru; // one per set
+  unsigned int* lru; // one per set
+  // state of the other replacement policies
+  int policy;
+  unsigned char* rrpv;     // srrip/brrip: one per line
+  unsigned long long* bits; // plru: tree node bits, bitplru: MRU bits; one per set
+  unsigned int* fill;      // fifo: next way, others: lines filled; one per set
+  unsigned long long rng;  // random/brrip: xorshift state
+  // 1 if the line was brought in by the prefetcher and not used since
+  unsigned char* prefetched;
+  struct prefetcher* prefetcher; // NULL when not prefetching
+  unsigned long long pc;         // address of the last I record
+  // the single allocation backing all the arrays
+  void* mem;
+  size_t mem_size;
+  // tag search kernel for this cache, and its name
+  tag_search_t search;
+  const char* search_name;
+  // print what every access does, as csim -v
+  int verbose;
+  // statistics; kept per cache so several caches can be simulated at once
+  long long hits;
+  long long misses;
+  long long evictions;
+  long long prefetches;          // prefetch fills
+  long long prefetch_hits;       // demand hits on lines the prefetcher brought in
+  long long useless_prefetches;  // prefetched lines evicted before any use
+  long long pollution;           // demand lines evicted by prefetch fills
+} cache_t;
+
+/* A snapshot of the counters of a cache */
+typedef struct cache_stats {
+  long long hits;
+  long long misses;
+  long long evictions;
+  long long prefetches;
+  long long prefetch_hits;
+  long long useless_prefetches;
+  long long pollution;
+} cache_stats_t;
+
+/* One access of a batch */
+typedef struct trace_op {
+  char operation;
+  unsigned long long address;
+} trace_op_t;
+
+/* Create an empty cache of 2^s sets of E lines of 2^b bytes. kernel names
+   the tag search kernel (avx2, sse4.1, scalar), NULL for the fastest the
+   CPU runs. Returns NULL if the geometry is out of range (s > 30,
+   s + b > 63), the policy cannot manage E-way sets, the kernel is unknown
+   or the CPU cannot run it, or memory runs out */
+cache_t* cache_init(int s, int E, int b, const char* kernel, int policy);
+
+/* Free a cache and its prefetcher */
+void cache_free(cache_t* cache);
+
+/* Empty the cache and zero its counters, keeping geometry, policy and
+   prefetcher */
+void cache_reset(cache_t* cache);
+
+/* Attach the prefetcher spec ("nextline", "stride" or "stream", with an
+   optional ":degree") to cache. Returns 0, or -1 on a bad spec or when
+   memory runs out */
+int cache_set_prefetcher(cache_t* cache, const char* spec);
+
+/* Simulate one access of operation I, L, S or M. Returns its enum outcome
+   (the load's, for M) */
+int cache_simulate(cache_t* cache, char operation, unsigned long long address, int size);
+
+/* Simulate n accesses in order; much faster than n cache_simulate calls */
+void cache_simulate_batch(cache_t* cache, const trace_op_t* ops, size_t n);
+
+/* Simulate every remaining access of a trace */
+void cache_replay(cache_t* cache, ctrace_reader_t* trace);
+
+/* Copy the counters of the cache to stats */
+void cache_stats(const cache_t* cache, cache_stats_t* stats);
+
+/* The policy called name, or -1 */
+int policy_parse(const char* name);
+
+/* Whether policy can manage sets of E lines */
+int policy_supports(int policy, int E);
+
+/* Check a prefetcher spec, returning its kind and degree. Returns 0, or
+   -1 if it names no prefetcher */
+int prefetcher_parse(const char* spec, int* kind, int* degree);
+
+/* The named tag search kernel, or with a NULL name the widest the CPU
+   runs; *chosen is set to the name of the one returned. NULL if the name
+   is unknown or the CPU cannot run that kernel */
+tag_search_t tag_search_select(const char* name, const char** chosen);
+
+/* Make line i of set k the most (touch) or least (demote) recently used */
+void cache_touch(cache_t* cache, size_t k, unsigned int i);
+void cache_demote(cache_t* cache, size_t k, unsigned int i);
+
+#endif /* CACHESIM_H */
@@ -0,0 +1,503 @@
+/*
+ * cachetrace.c - Memory trace reader and writer (see cachetrace.h)
+ *
+ * Both formats are read straight out of an mmap of the whole file. Text
+ * lines are decoded in place with a table-driven hex scanner rather than
+ * fgets and sscanf. Binary blocks are inflated one at a time into a
+ * buffer in the reader and decoded a record at a time from there. Text
+ * from a pipe is read into that same buffer, and decoded one buffer of
+ * whole lines at a time.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "cachetrace.h"
+
+#define MAGIC_LEN 8
+
+/* Operations in the order of their 2-bit codes */
+static const char ops[] = "ILSM";
+
+/*
+ * Value of each byte as a hex digit, -1 if it is not one. A constant
+ * table, so that readers on several threads share it without setup.
+ */
+#define X -1
+static const signed char hex_value[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
+/* function prototypes */
+static int next_text(ctrace_reader_t *r, char *op, unsigned long long *addr,
+                     int *size);
+static int next_binary(ctrace_reader_t *r, char *op, unsigned long long *addr,
+                       int *size);
+static int refill(ctrace_reader_t *r);
+static int get_varint(ctrace_reader_t *r, unsigned long long *v);
+static unsigned char *put_varint(unsigned char *p, unsigned long long v);
+static int flush_block(ctrace_writer_t *w);
+
+/*
+ * ctrace_open - Map the trace at path and get ready to decode it
+ */
+int ctrace_open(ctrace_reader_t *r, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    r->size = st.st_size;
+
+    /* mmap refuses empty files, and an empty trace needs no mapping */
+    if (r->size > 0) {
+        void *data = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        /* We only ever walk forwards, so let the kernel read ahead */
+        posix_madvise(data, r->size, POSIX_MADV_SEQUENTIAL);
+        r->data = data;
+    }
+    close(fd);
+
+    r->p = r->data;
+    r->end = r->data + r->size;
+    if (r->size >= MAGIC_LEN && memcmp(r->data, CTRACE_MAGIC, MAGIC_LEN) == 0) {
+        r->binary = 1;
+        r->next = r->data + MAGIC_LEN;
+        r->p = r->end = r->block;    /* no block loaded yet */
+    }
+    return 0;
+}
+
+/*
+ * ctrace_fdopen - Get ready to decode the lackey text arriving on fd
+ */
+int ctrace_fdopen(ctrace_reader_t *r, int fd)
+{
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->p = r->end = r->tail = r->block;
+    return 0;
+}
+
+/*
+ * ctrace_next - Decode the next record into op, addr and size
+ */
+int ctrace_next(ctrace_reader_t *r, char *op, unsigned long long *addr,
+                int *size)
+{
+    if (r->binary)
+        return next_binary(r, op, addr, size);
+    if (r->fd < 0)
+        return next_text(r, op, addr, size);
+    do {
+        if (next_text(r, op, addr, size))
+            return 1;
+    } while (refill(r));
+    return 0;
+}
+
+/*
+ * ctrace_close - Unmap the trace
+ */
+void ctrace_close(ctrace_reader_t *r)
+{
+    if (r->size > 0)
+        munmap((void *)r->data, r->size);
+    r->data = r->p = r->end = r->next = NULL;
+    r->size = 0;
+}
+
+/*
+ * ctrace_create - Start a binary trace at path
+ */
+ctrace_writer_t *ctrace_create(const char *path)
+{
+    ctrace_writer_t *w;
+
+    if ((w = calloc(1, sizeof(ctrace_writer_t))) == NULL)
+        return NULL;
+    w->zsize = compressBound(sizeof(w->buf));
+    if ((w->zbuf = malloc(w->zsize)) == NULL) {
+        free(w);
+        return NULL;
+    }
+    if ((w->fp = fopen(path, "wb")) == NULL) {
+        free(w->zbuf);
+        free(w);
+        return NULL;
+    }
+    if (fwrite(CTRACE_MAGIC, 1, MAGIC_LEN, w->fp) != MAGIC_LEN) {
+        fclose(w->fp);
+        free(w->zbuf);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/*
+ * ctrace_set_thread - Tag the records written from now on with thread
+ */
+void ctrace_set_thread(ctrace_writer_t *w, int thread)
+{
+    w->next_thread = thread;
+}
+
+/*
+ * ctrace_write - Append one record to the current block, coding its
+ *     address against the closest predictor slot
+ */
+int ctrace_write(ctrace_writer_t *w, char op, unsigned long long addr,
+                 int size)
+{
+    unsigned long long delta, dist, best_dist = ~0ULL;
+    const char *c = strchr(ops, op);
+    int k, best = 0, lru = 0;
+    unsigned char head, *p;
+
+    if (op == '\0' || c == NULL || size < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Leave room in the block for a thread switch and this record */
+    if (w->nrecords + 2 > CTRACE_BLOCK && flush_block(w) < 0)
+        return -1;
+    if (w->next_thread != w->thread) {
+        p = w->buf + w->len;
+        *p++ = 0;
+        p = put_varint(p, 0);
+        p = put_varint(p, (unsigned)w->next_thread);
+        w->len = p - w->buf;
+        w->thread = w->next_thread;
+        w->nrecords++;
+    }
+
+    for (k = 0; k < CTRACE_SLOTS; k++) {
+        dist = (addr >= w->slot[k]) ? addr - w->slot[k] : w->slot[k] - addr;
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = k;
+        }
+        if (w->used[k] < w->used[lru])
+            lru = k;
+    }
+    /*
+     * An address far from every slot starts a new stream: give it the
+     * least recently used slot instead of clobbering a close one
+     */
+    if (best_dist >= (1ULL << 20))
+        best = lru;
+    /*
+     * Head 0 with a varint size of 0 is a thread switch, so an I record
+     * of size 0 that needs a delta must not be coded against slot 0
+     */
+    if (c == ops && size == 0 && best == 0 && addr != w->slot[0])
+        best = 1;
+
+    delta = addr - w->slot[best];
+    head = (c - ops) | best << 2;
+    if (size >= 1 && size <= 6)
+        head |= size << 4;
+    else if (size == 8)
+        head |= 7 << 4;
+    if (delta == 0)
+        head |= 0x80;
+
+    p = w->buf + w->len;
+    *p++ = head;
+    if (((head >> 4) & 7) == 0)
+        p = put_varint(p, (unsigned)size);
+    if (delta != 0)
+        p = put_varint(p, (delta << 1) ^ -(delta >> 63));   /* zigzag */
+    w->len = p - w->buf;
+
+    w->slot[best] = addr + size;
+    w->used[best] = ++w->clock;
+    w->nrecords++;
+    return 0;
+}
+
+/*
+ * ctrace_finish - Write out the last block and close the trace
+ */
+int ctrace_finish(ctrace_writer_t *w)
+{
+    int rc = 0;
+
+    if (w->nrecords > 0 && flush_block(w) < 0)
+        rc = -1;
+    if (fclose(w->fp) != 0)
+        rc = -1;
+    free(w->zbuf);
+    free(w);
+    return rc;
+}
+
+/*
+ * next_text - Decode the next well-formed lackey line,
+ *
+ *     [blanks] op [blanks] hexaddr , decsize newline
+ *
+ *     skipping lines of any other shape (valgrind banners, blank lines).
+ */
+static int next_text(ctrace_reader_t *r, char *op, unsigned long long *addr,
+                     int *size)
+{
+    const unsigned char *p = r->p, *end = r->end;
+    const unsigned char *line, *digits, *nl;
+    unsigned long long a;
+    int d, n, ok;
+
+    while (p < end) {
+        /* Leading blanks, then the operation character */
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        line = p;
+        if (p < end && *p != '\n')
+            *op = *p++;
+
+        /* Blanks between the operation and the address */
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+
+        /* The address in hex: one load, compare and shift-or per digit */
+        a = 0;
+        digits = p;
+        while (p < end && (d = hex_value[*p]) >= 0) {
+            a = (a << 4) | d;
+            p++;
+        }
+        ok = digits > line && p > digits && p < end && *p == ',';
+
+        /* The access size in decimal, then maybe a thread id */
+        n = 0;
+        r->thread = 0;
+        if (ok) {
+            p++;
+            while (p < end && (unsigned)(*p - '0') < 10) {
+                n = n * 10 + (*p - '0');
+                p++;
+            }
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            while (p < end && (unsigned)(*p - '0') < 10) {
+                r->thread = r->thread * 10 + (*p - '0');
+                p++;
+            }
+        }
+
+        /* Move on to the next line whatever happened */
+        nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+        if (ok) {
+            r->p = p;
+            *addr = a;
+            *size = n;
+            return 1;
+        }
+    }
+    r->p = p;
+    return 0;
+}
+
+/*
+ * next_binary - Decode the next record, inflating the next block if the
+ *     current one is used up
+ */
+static int next_binary(ctrace_reader_t *r, char *op, unsigned long long *addr,
+                       int *size)
+{
+    unsigned long long nrec, rawbytes, zbytes, v;
+    const unsigned char *file_end = r->data + r->size;
+    uLongf len;
+    unsigned char head;
+    int k;
+
+    while (r->left == 0) {
+        /* Block header; a truncated or corrupt trace simply ends early */
+        r->p = r->next;
+        r->end = file_end;
+        if (r->p >= file_end || get_varint(r, &nrec) < 0 ||
+            get_varint(r, &rawbytes) < 0 || get_varint(r, &zbytes) < 0 ||
+            rawbytes > sizeof(r->block) || zbytes > (size_t)(file_end - r->p))
+            return 0;
+        len = rawbytes;
+        if (uncompress(r->block, &len, r->p, zbytes) != Z_OK || len != rawbytes)
+            return 0;
+        r->next = r->p + zbytes;
+        r->p = r->block;
+        r->end = r->block + rawbytes;
+        r->left = nrec;
+        r->thread = 0;
+        memset(r->slot, 0, sizeof(r->slot));
+    }
+
+    if (r->p >= r->end)
+        return 0;
+    head = *r->p++;
+    k = (head >> 2) & 3;
+    *op = ops[head & 3];
+
+    switch ((head >> 4) & 7) {
+    case 0:
+        if (get_varint(r, &v) < 0)
+            return 0;
+        *size = (int)v;
+        if (head == 0 && v == 0) {
+            /* Thread switch, not an access */
+            if (get_varint(r, &v) < 0)
+                return 0;
+            r->thread = (int)v;
+            r->left--;
+            return next_binary(r, op, addr, size);
+        }
+        break;
+    case 7:
+        *size = 8;
+        break;
+    default:
+        *size = (head >> 4) & 7;
+    }
+
+    if (head & 0x80) {
+        *addr = r->slot[k];
+    } else {
+        if (get_varint(r, &v) < 0)
+            return 0;
+        *addr = r->slot[k] + ((v >> 1) ^ -(v & 1));   /* unzigzag */
+    }
+    r->slot[k] = *addr + *size;
+    r->left--;
+    return 1;
+}
+
+/*
+ * refill - Move the partial line left at the end of block[] to its start
+ *     and read more of the pipe after it, until block[] holds at least
+ *     one whole line. r->end is then the end of the last whole line (or
+ *     of everything, at the end of the pipe or if no line fits). Returns
+ *     0 when there is nothing left to decode.
+ */
+static int refill(ctrace_reader_t *r)
+{
+    size_t left = r->tail - r->end;
+    unsigned char *p, *nl = NULL;
+    ssize_t n = 0;
+
+    memmove(r->block, r->end, left);
+    r->p = r->block;
+    r->tail = r->block + left;
+    while (r->tail < r->block + sizeof(r->block)) {
+        n = read(r->fd, r->tail, r->block + sizeof(r->block) - r->tail);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        r->tail += n;
+        if (memchr(r->tail - n, '\n', n))
+            break;
+    }
+    for (p = r->tail; p > r->block; p--) {
+        if (p[-1] == '\n') {
+            nl = p;
+            break;
+        }
+    }
+    r->end = (nl && n > 0) ? nl : r->tail;
+    return r->end > r->p;
+}
+
+/*
+ * get_varint - Read a little-endian base-128 varint. Returns 0, or -1
+ *     if it runs past the end of the block.
+ */
+static int get_varint(ctrace_reader_t *r, unsigned long long *v)
+{
+    unsigned long long x = 0;
+    int shift;
+
+    for (shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        unsigned char byte = *r->p++;
+        x |= (unsigned long long)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *v = x;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * put_varint - Store a varint at p and return the byte after it
+ */
+static unsigned char *put_varint(unsigned char *p, unsigned long long v)
+{
+    while (v >= 0x80) {
+        *p++ = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (unsigned char)v;
+    return p;
+}
+
+/*
+ * flush_block - Deflate and write the buffered block, then reset the
+ *     predictors
+ */
+static int flush_block(ctrace_writer_t *w)
+{
+    unsigned char hdr[30], *p;
+    uLongf zlen = w->zsize;
+
+    if (compress2(w->zbuf, &zlen, w->buf, w->len, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return -1;
+    p = put_varint(hdr, w->nrecords);
+    p = put_varint(p, w->len);
+    p = put_varint(p, zlen);
+    if (fwrite(hdr, 1, p - hdr, w->fp) != (size_t)(p - hdr) ||
+        fwrite(w->zbuf, 1, zlen, w->fp) != zlen)
+        return -1;
+
+    w->nrecords = 0;
+    w->len = 0;
+    memset(w->slot, 0, sizeof(w->slot));
+    memset(w->used, 0, sizeof(w->used));
+    w->clock = 0;
+    w->thread = 0;
+    return 0;
+}
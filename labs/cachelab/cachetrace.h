@@ -0,0 +1,115 @@
+/*
+ * cachetrace.h - Reading and writing memory traces for Cache Lab
+ *
+ * Traces come in two formats. The text format is what valgrind's lackey
+ * tool prints, one access per line:
+ *
+ *   I  0400d7d4,8
+ *    L 7ff0005b8,8
+ *
+ * Traces of multithreaded programs may end a line with the id of the
+ * thread that made the access (" S 7ff0005b8,8 2"); lines without one
+ * belong to thread 0.
+ *
+ * The binary format stores the same records in a small fraction of the
+ * space. A file is the 8-byte magic CTRACE_MAGIC followed by blocks:
+ *
+ *   varint nrecords, varint rawbytes, varint zbytes, zbytes of zlib data
+ *
+ * The zlib data inflates to rawbytes bytes of records. Every block starts
+ * from a fresh predictor state, so it can be decoded on its own. Within
+ * a block each record is
+ *
+ *   head byte, [varint size], [varint zigzag(addr - slot[k])]
+ *
+ * where the head byte packs
+ *
+ *   bits 0-1  operation (I, L, S, M)
+ *   bits 2-3  k, the predictor slot the address is a delta against
+ *   bits 4-6  size 1-6, 7 for size 8, or 0 if a varint size follows
+ *   bit  7    set if the address equals slot[k], so no delta follows
+ *
+ * Each of the CTRACE_SLOTS slots holds the end address (addr + size) of
+ * the last access coded against it. A stream of sequential accesses
+ * (instruction fetches, array walks) then costs one byte per record, and
+ * a few interleaved streams (code, stack, heap) each keep their own slot.
+ *
+ * A head byte of 0 followed by a varint 0 (an I record of size 0 with a
+ * delta against slot 0, which the writer never produces: it codes such a
+ * record against slot 1) is not an access but switches the thread of the
+ * records after it to the varint that follows. Blocks start in thread 0.
+ *
+ * ctrace_open reads either format, telling them apart by the magic.
+ * ctrace_fdopen reads lackey text from a pipe as it arrives, e.g. from a
+ * valgrind run, a buffer at a time.
+ */
+#ifndef CACHETRACE_H
+#define CACHETRACE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define CTRACE_MAGIC "CTRACE1\n"   /* first 8 bytes of a binary trace */
+#define CTRACE_BLOCK 4096          /* records per block */
+#define CTRACE_SLOTS 4             /* address predictors per block */
+#define CTRACE_MAXREC 16           /* max encoded bytes of one record */
+
+/* A trace being read: the mapped file and the decoder state */
+typedef struct ctrace_reader {
+    const unsigned char *data;     /* start of the mapped file */
+    const unsigned char *p;        /* next byte to decode */
+    const unsigned char *end;      /* end of the text, or of block[] */
+    const unsigned char *next;     /* header of the next binary block */
+    size_t size;                   /* length of the mapped file */
+    int binary;                    /* 1 if the file has CTRACE_MAGIC */
+    int fd;                        /* text read from a pipe, or -1 */
+    unsigned char *tail;           /* end of the text read into block[] */
+    int thread;                    /* thread of the last record decoded */
+    unsigned long left;            /* records left in the current block */
+    unsigned long long slot[CTRACE_SLOTS];
+    unsigned char block[CTRACE_BLOCK * CTRACE_MAXREC];  /* inflated block */
+} ctrace_reader_t;
+
+/* A binary trace being written, one block buffered at a time */
+typedef struct ctrace_writer {
+    FILE *fp;
+    unsigned long nrecords;        /* records in buf */
+    size_t len;                    /* bytes used in buf */
+    unsigned char buf[CTRACE_BLOCK * CTRACE_MAXREC];
+    unsigned char *zbuf;           /* buf deflated for writing */
+    unsigned long zsize;           /* capacity of zbuf */
+    unsigned long long slot[CTRACE_SLOTS];
+    unsigned long used[CTRACE_SLOTS];  /* when each slot was last used */
+    unsigned long clock;
+    int thread;                    /* thread of the records in buf so far */
+    int next_thread;               /* thread of the next record */
+} ctrace_writer_t;
+
+/* Map the trace at path for reading. Returns 0, or -1 with errno set */
+int ctrace_open(ctrace_reader_t *r, const char *path);
+
+/* Read lackey text from fd as it arrives. The caller closes fd. Returns 0 */
+int ctrace_fdopen(ctrace_reader_t *r, int fd);
+
+/* Decode the next record; r->thread is its thread. Returns 1, or 0 at
+   the end of the trace */
+int ctrace_next(ctrace_reader_t *r, char *op, unsigned long long *addr,
+                int *size);
+
+/* Unmap the trace (a pipe is left open) */
+void ctrace_close(ctrace_reader_t *r);
+
+/* Create a binary trace at path. Returns NULL with errno set on error */
+ctrace_writer_t *ctrace_create(const char *path);
+
+/* Make the records written from now on belong to thread */
+void ctrace_set_thread(ctrace_writer_t *w, int thread);
+
+/* Append one record. Returns 0, or -1 on a write error */
+int ctrace_write(ctrace_writer_t *w, char op, unsigned long long addr,
+                 int size);
+
+/* Flush the last block and close the file. Returns 0, or -1 on error */
+int ctrace_finish(ctrace_writer_t *w);
+
+#endif /* CACHETRACE_H */
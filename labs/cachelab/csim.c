@@ -1,16 +1,19 @@
+// for clock_gettime under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
 #include "cachelab.h"
+#include "cachesim.h"
+#include "cachetrace.h"
 #include <ctype.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-// global variables
-int hits;
-int misses;
-int evictions;
-
 // config variables
 typedef struct cache_config {
   int s;           // Number of set index bits
@@ -18,6 +21,18 @@ typedef struct cache_config {
   int b;           // Number of block bits
   char* tracefile; // Path to the tracefile
   int verbose;     // Verbose mode flag
+  int bench;       // Benchmark mode: times to replay the trace (0 = off)
+  char* kernel;    // Tag search kernel to force, NULL = pick the fastest
+  char* grid;      // Grid mode: list of geometries to simulate at once (-m)
+  int jobs;        // Grid mode: worker threads, 0 = one per CPU; otherwise set shards
+  int distance;    // Stack distance mode: every s <= -s and E <= -E at once
+  char* levels;    // Hierarchy mode: s:E:latency of each level, then memory latency
+  char* inclusion; // Hierarchy mode: inclusive, exclusive or nine
+  int policy;      // Replacement policy, one of enum policy
+  char* prefetch;  // Prefetcher (-F), NULL for demand fetching only
+  char* protocol;  // Coherence mode: mesi or moesi (-C)
+  char* llc;       // Coherence mode: s:E of the shared last level cache (-l)
+  char* report;    // Report mode: file for the per-set CSV (-R)
 } cache_config_t;
 
 /** Chapter 6 Part A: Cache Simulator
@@ -42,288 +57,1636 @@ typedef struct cache_config {
  *
  */
 
+
+void print_usage(char* prog_name) {
+  printf("Usage: %s [-hv] -s <s> -E <E> -b <b> -t <tracefile>\n", prog_name);
+  printf("  -h  : Print this help message\n");
+  printf("  -v  : Enable verbose output\n");
+  printf("  -s <s> : Number of set index bits (S = 2^s is the number of sets)\n");
+  printf("  -E <E> : Number of lines per set (associativity)\n");
+  printf("  -b <b> : Number of block bits (B = 2^b is the block size)\n");
+  printf("  -t <tracefile> : Path to the valgrind trace file (text or tracecvt binary)\n");
+  printf("  -B <n> : Benchmark: replay the trace n times from memory, report accesses/sec\n");
+  printf("  -k <kernel> : Tag search kernel: avx2, sse4.1 or scalar (default: fastest)\n");
+  printf("  -m <grid> : Simulate many geometries in one pass instead of -s/-E/-b, e.g.\n");
+  printf("              -m 0-6:1/2/4:5 (s = 0..6, E = 1, 2 or 4, b = 5); join grids with ','\n");
+  printf("  -j <n> : Worker threads for -m (default: one per CPU); without -m, split\n");
+  printf("           the sets among n threads (not with -v, -F, random, brrip, -D, -R, -L,\n");
+  printf("           -C or -B)\n");
+  printf("  -D : Stack distance mode: LRU results for every s <= <s> and every\n");
+  printf("       power-of-two E <= <E> in one pass per s, as miss ratio curves\n");
+  printf("  -L <levels> : Hierarchy mode, write-back/write-allocate levels of 2^b byte\n");
+  printf("                blocks from L1 down, as s:E:latency, then the memory latency,\n");
+  printf("                e.g. -b 6 -L 6:8:4,10:4:12,13:16:40,200\n");
+  printf("  -I <policy> : Hierarchy inclusion: inclusive, exclusive or nine (default)\n");
+  printf("  -p <policy> : Replacement policy: lru (default), fifo, random, plru,\n");
+  printf("                bitplru, srrip or brrip (plru needs E a power of 2, plru and\n");
+  printf("                bitplru E <= 64; -L and -D always use lru)\n");
+  printf("  -F <pf>[:n] : Prefetcher: nextline, stride or stream, n blocks ahead\n");
+  printf("  -C <proto> : Coherence mode: one -s/-E/-b L1 per thread of a thread-tagged\n");
+  printf("               trace, kept coherent with mesi or moesi over a shared LLC\n");
+  printf("  -l <s:E> : Coherence mode: LLC geometry (default: 4x the sets and ways)\n");
+  printf("  -R <csv> : Report mode: split misses into compulsory, capacity and conflict,\n");
+  printf("             print the sets and blocks missing most, and write per-set counts\n");
+  printf("             to <csv> (not with -F)\n");
+}
+
+// modify the config object accordingly, returns nothing
+void parse_arguments(int argc, char** argv, cache_config_t* config) {
+  int opt;
+  const char* chosen;
+  while ((opt = getopt(argc, argv, "hvs:E:b:t:B:k:m:j:DL:I:p:F:C:l:R:")) != -1) {
+    switch (opt) {
+    case 'h':
+      print_usage(argv[0]);
+      exit(0);
+    case 'v':
+      config->verbose = 1;
+      break;
+    case 's':
+      config->s = atoi(optarg);
+      break;
+    case 'E':
+      config->E = atoi(optarg);
+      break;
+    case 'b':
+      config->b = atoi(optarg);
+      break;
+    case 't':
+      config->tracefile = optarg;
+      break;
+    case 'B':
+      config->bench = atoi(optarg);
+      break;
+    case 'k':
+      config->kernel = optarg;
+      if (tag_search_select(optarg, &chosen) == NULL) {
+        printf("Error: tag search kernel '%s' is unknown or not supported by this CPU\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'm':
+      config->grid = optarg;
+      break;
+    case 'j':
+      config->jobs = atoi(optarg);
+      break;
+    case 'D':
+      config->distance = 1;
+      break;
+    case 'L':
+      config->levels = optarg;
+      break;
+    case 'I':
+      config->inclusion = optarg;
+      break;
+    case 'F':
+      config->prefetch = optarg;
+      break;
+    case 'C':
+      config->protocol = optarg;
+      break;
+    case 'l':
+      config->llc = optarg;
+      break;
+    case 'R':
+      config->report = optarg;
+      break;
+    case 'p':
+      config->policy = policy_parse(optarg);
+      if (config->policy < 0) {
+        printf("Error: unknown replacement policy '%s'\n", optarg);
+        print_usage(argv[0]);
+        exit(1);
+      }
+      break;
+    default:
+      print_usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  // Check if required arguments are provided
+  // s = 0 (fully associative) and b = 0 (1-byte blocks) are legal
+  // (grid mode takes its geometries from -m, hierarchy mode its s and E from -L)
+  int grid = config->grid != NULL;
+  if ((!grid && config->levels == NULL && (config->s < 0 || config->E <= 0)) ||
+      (!grid && config->b < 0) || config->tracefile == NULL) {
+    printf("Error: Missing required arguments\n");
+    print_usage(argv[0]);
+    exit(1);
+  }
+  int kind, degree;
+  if (config->prefetch != NULL && prefetcher_parse(config->prefetch, &kind, &degree) < 0) {
+    printf("Error: -F must be nextline, stride or stream, optionally with :<degree>\n");
+    exit(1);
+  }
+  if (!grid && config->levels == NULL && !policy_supports(config->policy, config->E)) {
+    printf("Error: %s cannot manage %d-way sets\n", policy_names[config->policy], config->E);
+    exit(1);
+  }
+}
+
+// map the trace at path for ctrace_next, which reads both lackey text and
+// the binary format of cachetrace.h
+void open_trace_file(ctrace_reader_t* trace, const char* path) {
+  if (ctrace_open(trace, path) < 0) {
+    perror("Error opening trace file");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// the cache of -s/-E/-b/-p/-F; NULL if it cannot be had
+cache_t* config_cache(const cache_config_t* config) {
+  cache_t* cache = cache_init(config->s, config->E, config->b, config->kernel, config->policy);
+  if (cache == NULL) {
+    return NULL;
+  }
+  if (config->prefetch != NULL && cache_set_prefetcher(cache, config->prefetch) < 0) {
+    cache_free(cache);
+    return NULL;
+  }
+  cache->verbose = config->verbose;
+  return cache;
+}
+
+// the cache of config, or exit if it is too large or malformed
+cache_t* config_cache_or_die(const cache_config_t* config) {
+  cache_t* cache = config_cache(config);
+  if (cache == NULL) {
+    printf("Error: cannot simulate a cache of s=%d, E=%d, b=%d\n", config->s, config->E,
+           config->b);
+    exit(EXIT_FAILURE);
+  }
+  return cache;
+}
+
+// Parse the trace file and simulate every access in it
+void parse_trace_file(cache_t* cache, cache_config_t* config) {
+  ctrace_reader_t trace;
+  open_trace_file(&trace, config->tracefile);
+  // do the full simulation in the loop specialized for the policy
+  cache_replay(cache, &trace);
+  ctrace_close(&trace);
+}
+
+// read the data accesses of the trace into an array; returns their number.
+// With insts, the I records are kept too (for the pc the stride prefetcher
+// keys on), and *insts is set to how many there are
+size_t load_trace_file(cache_config_t* config, trace_op_t** ops_out, size_t* insts) {
+  ctrace_reader_t trace;
+  char operation;
+  unsigned long long address;
+  int size;
+
+  open_trace_file(&trace, config->tracefile);
+  size_t n = 0, cap = 1 << 16;
+  trace_op_t* ops = malloc(cap * sizeof(trace_op_t));
+  if (insts != NULL) {
+    *insts = 0;
+  }
+  while (ops != NULL && ctrace_next(&trace, &operation, &address, &size)) {
+    if (operation == 'I') {
+      if (insts == NULL) {
+        continue;
+      }
+      (*insts)++;
+    }
+    if (n == cap) {
+      cap *= 2;
+      ops = realloc(ops, cap * sizeof(trace_op_t));
+      if (ops == NULL) {
+        break;
+      }
+    }
+    ops[n].operation = operation;
+    ops[n].address = address;
+    n++;
+  }
+  ctrace_close(&trace);
+  if (ops == NULL) {
+    printf("Error! Trace memory not allocated");
+    exit(EXIT_FAILURE);
+  }
+  *ops_out = ops;
+  return n;
+}
+
+// the prefetch counters of a cache that has a prefetcher
+void print_prefetch_stats(const cache_t* cache) {
+  printf("prefetches:%lld prefetch_hits:%lld useless:%lld pollution:%lld\n", cache->prefetches,
+         cache->prefetch_hits, cache->useless_prefetches, cache->pollution);
+}
+
+// seconds on a monotonic clock
+double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// benchmark mode: time only the simulation, on a fresh cache per replay
+void benchmark(cache_config_t* config) {
+  trace_op_t* ops;
+  size_t insts;
+  size_t n = load_trace_file(config, &ops, &insts);
+  const char* kernel = NULL;
+  double secs = 0;
+  cache_t* last = NULL;
+
+  for (int r = 0; r < config->bench; r++) {
+    cache_t* cache = config_cache_or_die(config);
+    kernel = cache->search_name;
+    double start = now_seconds();
+    cache_simulate_batch(cache, ops, n);
+    secs += now_seconds() - start;
+    // keep the last replay's cache for its counters
+    if (last != NULL) {
+      cache_free(last);
+    }
+    last = cache;
+  }
+  n -= insts;
+  printf("benchmark: %zu accesses x %d replays in %.3f s, %.1f M accesses/sec (%s tag search, "
+         "%s)\n",
+         n, config->bench, secs, n * (double)config->bench / secs / 1e6, kernel,
+         policy_names[config->policy]);
+  printSummary((int)last->hits, (int)last->misses, (int)last->evictions);
+  if (last->prefetcher != NULL) {
+    print_prefetch_stats(last);
+  }
+  cache_free(last);
+  free(ops);
+}
+
 /**
- * Simulates a line in a cache
+ * Grid mode
+ *
+ * Sweeping cache geometries one csim run at a time re-reads and re-parses
+ * the trace for every geometry. Grid mode decodes the trace once into
+ * memory and hands the geometries out to a pool of worker threads, each
+ * replaying the shared (read-only) trace against its own cache. A worker
+ * takes the next geometry from a shared counter, so a few slow, highly
+ * associative geometries do not hold up the rest.
  */
-typedef struct cache_line {
-  // 0 for invalid, 1 for valid
-  int valid;
-  // tag bits are always 64bit here
-  // unsigned long long guarantees 64 bits on all platforms
-  unsigned long long tag;
-  // LRU implementation
-  //  this tracks how long a line was last accessed
-  //  loop increased the time for all lines
-  //  once its accessed, reset the time to 0
-  //  when evicting, choose the one with the highest time
-  unsigned int time;
-  // use cache_line_t here as a placeholder for the typedef of the cache_line struct]
-} cache_line_t;
+#define GRID_MAX 4096   // most geometries one -m may ask for
+#define GRID_VALUES 64  // most values one of s, E or b may take in a grid
+
+typedef struct grid_result {
+  cache_config_t config;
+  long long hits;
+  long long misses;
+  long long evictions;
+  cache_stats_t stats;  // the prefetch counters, with -F
+} grid_result_t;
+
+typedef struct grid {
+  grid_result_t* results;  // one per geometry, in the order given
+  int n;                   // number of geometries
+  int next;                // next geometry to hand out
+  pthread_mutex_t lock;    // protects next
+  const trace_op_t* ops;   // the decoded trace, shared by every worker
+  size_t nops;
+} grid_t;
+
+// parse one of the s, E or b lists of a grid, e.g. "0-3/5"; returns the
+// number of values, or -1 if the list is malformed
+int parse_grid_values(const char* str, size_t len, int* values) {
+  int n = 0;
+  const char* end = str + len;
+  while (str < end) {
+    char* stop;
+    long lo = strtol(str, &stop, 10), hi = lo;
+    if (stop == str) {
+      return -1;
+    }
+    if (stop < end && *stop == '-') {
+      str = stop + 1;
+      hi = strtol(str, &stop, 10);
+      if (stop == str) {
+        return -1;
+      }
+    }
+    for (long v = lo; v <= hi; v++) {
+      if (n == GRID_VALUES) {
+        return -1;
+      }
+      values[n++] = (int)v;
+    }
+    if (stop < end && *stop != '/') {
+      return -1;
+    }
+    str = (stop < end) ? stop + 1 : end;
+  }
+  return n;
+}
+
+// expand the -m argument into one result slot per geometry
+// returns the number of geometries, or -1 if the grid is malformed
+int parse_grid(cache_config_t* config, grid_result_t* results) {
+  int n = 0;
+  const char* spec = config->grid;
+  while (*spec) {
+    // one grid: s-list:E-list:b-list, up to the next ','
+    size_t len = strcspn(spec, ",");
+    int values[3][GRID_VALUES], count[3];
+    const char* field = spec;
+    for (int f = 0; f < 3; f++) {
+      size_t flen = strcspn(field, ":,");
+      if (flen > (size_t)(spec + len - field) || (f < 2 && field[flen] != ':') ||
+          (count[f] = parse_grid_values(field, flen, values[f])) <= 0) {
+        return -1;
+      }
+      field += flen + 1;
+    }
+    if (field != spec + len + 1) {
+      return -1;
+    }
+    for (int i = 0; i < count[0]; i++) {
+      for (int j = 0; j < count[1]; j++) {
+        for (int k = 0; k < count[2]; k++) {
+          int s = values[0][i], E = values[1][j], b = values[2][k];
+          // s + b bits must leave room in a 64 bit address for the tag
+          if (s < 0 || s > 30 || E <= 0 || b < 0 || s + b > 63 || n == GRID_MAX ||
+              !policy_supports(config->policy, E)) {
+            return -1;
+          }
+          results[n].config = *config;
+          results[n].config.s = s;
+          results[n].config.E = E;
+          results[n].config.b = b;
+          n++;
+        }
+      }
+    }
+    spec += len;
+    if (*spec == ',') {
+      spec++;
+    }
+  }
+  return n;
+}
+
+// print a table of results, one geometry per row, with the prefetch
+// counters if prefetch is set
+void print_results(grid_result_t* results, int n, int prefetch) {
+  printf("%4s %6s %4s %12s %10s %10s %10s %8s", "s", "E", "b", "size(B)", "hits", "misses",
+         "evictions", "miss%");
+  if (prefetch) {
+    printf(" %10s %10s %10s %10s", "prefetches", "pf_hits", "useless", "pollution");
+  }
+  printf("\n");
+  for (int k = 0; k < n; k++) {
+    grid_result_t* r = &results[k];
+    if (r->hits < 0) {
+      printf("%4d %6d %4d   (cache too large to allocate)\n", r->config.s, r->config.E,
+             r->config.b);
+      continue;
+    }
+    unsigned long long size = (1ULL << r->config.s) * r->config.E << r->config.b;
+    long long accesses = r->hits + r->misses;
+    printf("%4d %6d %4d %12llu %10lld %10lld %10lld %7.2f%%", r->config.s, r->config.E, r->config.b,
+           size, r->hits, r->misses, r->evictions, accesses ? 100.0 * r->misses / accesses : 0.0);
+    if (prefetch) {
+      printf(" %10lld %10lld %10lld %10lld", r->stats.prefetches, r->stats.prefetch_hits,
+             r->stats.useless_prefetches, r->stats.pollution);
+    }
+    printf("\n");
+  }
+}
+
+// worker thread: simulate geometries until there are none left
+void* grid_worker(void* arg) {
+  grid_t* grid = arg;
+  for (;;) {
+    pthread_mutex_lock(&grid->lock);
+    int k = grid->next++;
+    pthread_mutex_unlock(&grid->lock);
+    if (k >= grid->n) {
+      return NULL;
+    }
+
+    grid_result_t* r = &grid->results[k];
+    cache_t* cache = config_cache(&r->config);
+    if (cache == NULL) {
+      r->hits = r->misses = r->evictions = -1;
+      continue;
+    }
+    cache_simulate_batch(cache, grid->ops, grid->nops);
+    r->hits = cache->hits;
+    r->misses = cache->misses;
+    r->evictions = cache->evictions;
+    cache_stats(cache, &r->stats);
+    cache_free(cache);
+  }
+}
+
+// grid mode: simulate every geometry of -m on one decoded copy of the trace
+void grid_simulate(cache_config_t* config) {
+  grid_t grid;
+  grid.results = malloc(GRID_MAX * sizeof(grid_result_t));
+  if (grid.results == NULL) {
+    printf("Error! Grid memory not allocated");
+    exit(EXIT_FAILURE);
+  }
+  config->verbose = 0;
+  grid.n = parse_grid(config, grid.results);
+  if (grid.n <= 0) {
+    printf("Error: bad geometry grid '%s' (at most %d geometries, 0 <= s <= 30, "
+           "E >= 1, s + b <= 63)\n",
+           config->grid, GRID_MAX);
+    exit(1);
+  }
+  grid.next = 0;
+  pthread_mutex_init(&grid.lock, NULL);
+  trace_op_t* ops;
+  size_t insts;
+  grid.nops = load_trace_file(config, &ops, &insts);
+  grid.ops = ops;
+
+  int jobs = (config->jobs > 0) ? config->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  if (jobs > grid.n) {
+    jobs = grid.n;
+  }
+  pthread_t* workers = malloc(jobs * sizeof(pthread_t));
+  if (workers == NULL) {
+    printf("Error! Thread memory not allocated");
+    exit(EXIT_FAILURE);
+  }
+  double start = now_seconds();
+  for (int t = 0; t < jobs; t++) {
+    if (pthread_create(&workers[t], NULL, grid_worker, &grid) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (int t = 0; t < jobs; t++) {
+    pthread_join(workers[t], NULL);
+  }
+  double secs = now_seconds() - start;
+
+  print_results(grid.results, grid.n, config->prefetch != NULL);
+  printf("%d geometries x %zu accesses on %d threads in %.3f s\n", grid.n, grid.nops - insts,
+         jobs, secs);
+
+  pthread_mutex_destroy(&grid.lock);
+  free(workers);
+  free(ops);
+  free(grid.results);
+}
 
 /**
- * Simulates a set of lines in a cache
+ * Stack distance mode
+ *
+ * Under LRU, an access hits in an E-way set exactly when fewer than E
+ * other blocks of that set were touched since the last access to its
+ * block (its stack distance, Mattson et al. 1970). One pass that records
+ * the stack distance of every access therefore gives the hits of every
+ * associativity at once, and one pass per s covers every cache size.
+ *
+ * Stack distances are counted with a Fenwick tree over the accesses of
+ * each set, laid out set after set. Each position holds 1 while it is the
+ * latest access to its block, so the distance of an access is the sum
+ * over the positions between it and the previous access to its block:
+ * O(log n) per access instead of walking an LRU stack.
  */
-typedef struct cache_set {
-  // array of lines
-  cache_line_t* lines;
-} cache_set_t;
-
-// init method
-cache_set_t* cache_set_init(int E) {
-  // First allocate the set structure itself
-  // This is literally allocating memory for a single pointer!
-  /** What happens if we used automatic allocation (on the stack)
-   *
-   * cache_set_t new_set;  // on stack
-    return &new_set;      // DANGEROUS! This memory will be invalid after function returns
-   */
-  cache_set_t* new_set = malloc(sizeof(cache_set_t));
-  // error handling
-  if (new_set == NULL) {
-    printf("Error! Set memory not allocated");
-    return NULL;
+
+// add v at position i (1-based) of a Fenwick tree of n entries
+static inline void fenwick_add(int* tree, size_t n, size_t i, int v) {
+  for (; i <= n; i += i & -i) {
+    tree[i] += v;
   }
+}
 
-  // Then allocate array of E lines; one contiguous block of memory
-  // requires only only one malloc call per set
-  new_set->lines = malloc(E * sizeof(cache_line_t));
-  if (new_set->lines == NULL) {
-    // Handle malloc failure
-    free(new_set);
-    printf("Error! Line memory not allocated");
-    return NULL;
+// sum of positions 1..i of a Fenwick tree
+static inline int fenwick_sum(const int* tree, size_t i) {
+  int sum = 0;
+  for (; i > 0; i -= i & -i) {
+    sum += tree[i];
+  }
+  return sum;
+}
+
+// LRU results of every E in Es[0..nE) for 2^s sets of 2^b byte blocks
+void stack_distances(const trace_op_t* ops, size_t n, int s, int b, const int* Es, int nE,
+                     grid_result_t* results) {
+  size_t S = (size_t)1 << s;
+  int Emax = Es[nE - 1];
+  // block -> its latest position, in an open addressing table at most half full
+  size_t hsize = 2;
+  while (hsize < 2 * n) {
+    hsize *= 2;
   }
-  // Initialize each line directly, instead of having separate constructor for line
-  for (int i = 0; i < E; i++) {
-    new_set->lines[i].valid = 0;
-    new_set->lines[i].tag = 0;
-    new_set->lines[i].time = 0;
+  unsigned long long* keys = malloc(hsize * sizeof(unsigned long long));
+  size_t* last = calloc(hsize, sizeof(size_t)); // 0 = empty slot
+  int* tree = calloc(n + 1, sizeof(int));
+  size_t* start = calloc(S + 1, sizeof(size_t)); // first position of each set
+  size_t* distinct = calloc(S, sizeof(size_t));  // blocks seen in each set
+  // histogram of stack distances below Emax; anything else misses every E
+  size_t* hist = calloc(Emax, sizeof(size_t));
+  if (!keys || !last || !tree || !start || !distinct || !hist) {
+    printf("Error! Stack distance memory not allocated");
+    exit(EXIT_FAILURE);
+  }
+
+  // lay the sets out one after another in the tree
+  for (size_t i = 0; i < n; i++) {
+    start[((ops[i].address >> b) & (S - 1)) + 1]++;
+  }
+  for (size_t k = 0; k < S; k++) {
+    start[k + 1] += start[k];
   }
-  return new_set;
+
+  int modifies = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned long long block = ops[i].address >> b;
+    size_t k = block & (S - 1);
+    size_t pos = ++start[k]; // the set's next position, 1-based
+    size_t h = (block * 0x9E3779B97F4A7C15ULL) >> 20 & (hsize - 1);
+    while (last[h] != 0 && keys[h] != block) {
+      h = (h + 1) & (hsize - 1);
+    }
+    if (last[h] != 0) {
+      // blocks of this set touched since this one was last
+      size_t d = fenwick_sum(tree, pos - 1) - fenwick_sum(tree, last[h]);
+      if (d < (size_t)Emax) {
+        hist[d]++;
+      }
+      fenwick_add(tree, n, last[h], -1);
+    } else {
+      keys[h] = block;
+      distinct[k]++;
+    }
+    fenwick_add(tree, n, pos, 1);
+    last[h] = pos;
+    // the store of a modify always hits
+    modifies += (ops[i].operation == 'M');
+  }
+
+  // hits(E) = accesses closer than E; every miss evicts once the set is full
+  for (int e = 0; e < nE; e++) {
+    size_t hits = 0, fills = 0;
+    for (int d = 0; d < Es[e]; d++) {
+      hits += hist[d];
+    }
+    for (size_t k = 0; k < S; k++) {
+      fills += (distinct[k] < (size_t)Es[e]) ? distinct[k] : (size_t)Es[e];
+    }
+    grid_result_t* r = &results[e];
+    r->config.s = s;
+    r->config.E = Es[e];
+    r->config.b = b;
+    r->hits = hits + modifies;
+    r->misses = n - hits;
+    r->evictions = n - hits - fills;
+  }
+  free(keys);
+  free(last);
+  free(tree);
+  free(start);
+  free(distinct);
+  free(hist);
+}
+
+// order results by cache size, then associativity
+int compare_results(const void* a, const void* b) {
+  const grid_result_t* x = a;
+  const grid_result_t* y = b;
+  int xs = x->config.s + x->config.b, ys = y->config.s + y->config.b;
+  unsigned long long xsize = (unsigned long long)x->config.E << xs;
+  unsigned long long ysize = (unsigned long long)y->config.E << ys;
+  if (xsize != ysize) {
+    return (xsize < ysize) ? -1 : 1;
+  }
+  return x->config.E - y->config.E;
+}
+
+// stack distance mode: miss ratio curves for every s <= -s, E <= -E
+void stack_distance_analysis(cache_config_t* config) {
+  int Es[32], nE = 0;
+  for (int E = 1; E <= config->E && nE < 32; E *= 2) {
+    Es[nE++] = E;
+  }
+  int nresults = (config->s + 1) * nE;
+  grid_result_t* results = calloc(nresults, sizeof(grid_result_t));
+  if (results == NULL || config->s > 30 || config->s + config->b > 63) {
+    printf("Error: -s %d -b %d is too large for stack distance mode\n", config->s, config->b);
+    exit(1);
+  }
+
+  trace_op_t* ops;
+  size_t n = load_trace_file(config, &ops, NULL);
+  double start = now_seconds();
+  for (int s = 0; s <= config->s; s++) {
+    stack_distances(ops, n, s, config->b, Es, nE, results + s * nE);
+  }
+  double secs = now_seconds() - start;
+
+  // read down the table for the miss ratio curve of each associativity
+  qsort(results, nresults, sizeof(grid_result_t), compare_results);
+  print_results(results, nresults, 0);
+  printf("%d geometries from %d stack distance passes over %zu accesses in %.3f s\n",
+         nresults, config->s + 1, n, secs);
+  free(ops);
+  free(results);
 }
 
 /**
- * Simulates the full cache
+ * Report mode
+ *
+ * Replays the trace through the cache while attributing every miss to one
+ * of the three Cs (Hill 1987):
+ *
+ *   compulsory  the first access to its block
+ *   capacity    would miss in a fully associative LRU cache of the same
+ *               number of lines too
+ *   conflict    would hit there; the set mapping (or the policy) lost it
+ *
+ * The fully associative cache is a shadow: an access hits in it when
+ * fewer than S * E other blocks were touched since its block's last
+ * access, counted with the Fenwick tree of stack distance mode over the
+ * whole trace as one set.
+ *
+ * Misses are accumulated per set and per block. The sets and blocks that
+ * miss most are printed; every set is written to a CSV file, one row per
+ * set, ready to be plotted as a heatmap.
  */
-typedef struct cache {
-  // double pointer
-  // pointer to an array of sets, each elem itself is a set pointer
-  cache_set_t** sets;
-  int S; // Number of sets (2^s)
-  int E; // Number of lines per set
-  int B; // Block size (2^b)
-} cache_t;
-
-// init the full cache
-cache_t* cache_init(int s, int E, int b) {
-  cache_t* cache = malloc(sizeof(cache_t));
-  if (cache == NULL)
-    return NULL;
+#define REPORT_SHOWN 10 // sets and blocks listed in the hotspot tables
 
-  // Calculate S and B
-  cache->S = 1 << s; // 2^s sets
-  cache->E = E;
-  cache->B = 1 << b; // 2^b bytes per block
+typedef struct set_report {
+  int set;
+  long long accesses;
+  long long misses;
+  long long compulsory;
+  long long capacity;
+  long long conflict;
+  long long evictions;
+} set_report_t;
 
-  // Allocate array of sets as an array of pointers
-  cache->sets = malloc(cache->S * sizeof(cache_set_t*));
-  if (cache->sets == NULL) {
-    free(cache);
-    return NULL;
+typedef struct block_report {
+  unsigned long long block;
+  size_t last;  // latest position in the trace, 1-based; 0 = empty slot
+  long long accesses;
+  long long misses;
+  long long capacity;
+  long long conflict;
+} block_report_t;
+
+// order set and block reports by misses, most first, then by address
+int compare_set_reports(const void* a, const void* b) {
+  const set_report_t* x = a;
+  const set_report_t* y = b;
+  if (x->misses != y->misses) {
+    return (x->misses < y->misses) - (x->misses > y->misses);
   }
+  return x->set - y->set;
+}
 
-  // Initialize each set
-  for (int i = 0; i < cache->S; i++) {
-    // moves i step forward from the pointer address
-    // * dereferences the pointer
-    cache->sets[i] = cache_set_init(cache->E);
+int compare_block_reports(const void* a, const void* b) {
+  const block_report_t* x = a;
+  const block_report_t* y = b;
+  if (x->misses != y->misses) {
+    return (x->misses < y->misses) - (x->misses > y->misses);
   }
-  return cache;
+  return (x->block > y->block) - (x->block < y->block);
 }
 
-// Simulate cache behaviour by doing appropriate load and stores
-void cache_simulate(cache_t* cache, cache_config_t* config, char operation,
-                    unsigned long long address) {
+// report mode: where the misses of one cache are, and why
+void miss_report(cache_config_t* config) {
+  if (config->prefetch != NULL) {
+    printf("Error: -R does not model prefetching\n");
+    exit(1);
+  }
+  config->verbose = 0;
+  FILE* csv = fopen(config->report, "w");
+  if (csv == NULL) {
+    perror(config->report);
+    exit(EXIT_FAILURE);
+  }
+  trace_op_t* ops;
+  size_t n = load_trace_file(config, &ops, NULL);
+  cache_t* cache = config_cache_or_die(config);
+  size_t S = (size_t)1 << config->s;
+  size_t lines = S * config->E;
+  size_t hsize = 2;
+  while (hsize < 2 * n) {
+    hsize *= 2;
+  }
+  set_report_t* sets = calloc(S, sizeof(set_report_t));
+  block_report_t* blocks = calloc(hsize, sizeof(block_report_t));
+  int* tree = calloc(n + 1, sizeof(int));
+  if (sets == NULL || blocks == NULL || tree == NULL) {
+    printf("Error! Report memory not allocated");
+    exit(EXIT_FAILURE);
+  }
 
-  // if operation is instruction (I), ignore completely
-  // use single quotes for char
-  if (operation == 'I') {
-    return;
+  long long compulsory = 0, capacity = 0, conflict = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned long long block = ops[i].address >> config->b;
+    set_report_t* set = &sets[block & (S - 1)];
+    size_t h = (block * 0x9E3779B97F4A7C15ULL) >> 20 & (hsize - 1);
+    while (blocks[h].last != 0 && blocks[h].block != block) {
+      h = (h + 1) & (hsize - 1);
+    }
+    block_report_t* br = &blocks[h];
+
+    // the shadow fully associative cache
+    int first = br->last == 0, shadow_hit = 0;
+    if (!first) {
+      size_t d = fenwick_sum(tree, i) - fenwick_sum(tree, br->last);
+      shadow_hit = d < lines;
+      fenwick_add(tree, n, br->last, -1);
+    }
+    br->block = block;
+    br->last = i + 1;
+    fenwick_add(tree, n, i + 1, 1);
+
+    // the real one
+    // an M record is two accesses (its store always hits), as in the totals
+    long long hits = cache->hits, misses = cache->misses, evictions = cache->evictions;
+    cache_simulate(cache, ops[i].operation, ops[i].address, 0);
+    long long made = cache->hits + cache->misses - hits - misses;
+    set->accesses += made;
+    br->accesses += made;
+    set->evictions += cache->evictions - evictions;
+    if (cache->misses == misses) {
+      continue;
+    }
+    set->misses++;
+    br->misses++;
+    if (first) {
+      set->compulsory++;
+      compulsory++;
+    } else if (!shadow_hit) {
+      set->capacity++;
+      br->capacity++;
+      capacity++;
+    } else {
+      set->conflict++;
+      br->conflict++;
+      conflict++;
+    }
   }
 
-  // Extract set index and tag from address
+  // every set, in order, for plotting
+  fprintf(csv, "set,accesses,misses,compulsory,capacity,conflict,evictions\n");
+  for (size_t k = 0; k < S; k++) {
+    set_report_t* r = &sets[k];
+    r->set = (int)k;
+    fprintf(csv, "%zu,%lld,%lld,%lld,%lld,%lld,%lld\n", k, r->accesses, r->misses, r->compulsory,
+            r->capacity, r->conflict, r->evictions);
+  }
+  if (fclose(csv) != 0) {
+    perror(config->report);
+    exit(EXIT_FAILURE);
+  }
 
-  // creates a mask of ones with s bits all set to one. if s is 3, then mask is 0b111
-  unsigned int index_mask = (1 << config->s) - 1;
-  // shift to right the block offset bits. then take the s bits
-  unsigned int set_index = (address >> config->b) & index_mask;
-  unsigned long long tag = address >> (config->s + config->b);
-  cache_set_t* set = cache->sets[set_index];
+  printSummary((int)cache->hits, (int)cache->misses, (int)cache->evictions);
+  long long total = cache->misses ? cache->misses : 1;
+  printf("compulsory:%lld (%.1f%%) capacity:%lld (%.1f%%) conflict:%lld (%.1f%%)\n", compulsory,
+         100.0 * compulsory / total, capacity, 100.0 * capacity / total, conflict,
+         100.0 * conflict / total);
 
-  if (config->verbose) {
-    printf(" | requesting set %d, tag %llx | ", set_index, tag);
+  qsort(sets, S, sizeof(set_report_t), compare_set_reports);
+  printf("\nsets missing most:\n%8s %10s %10s %10s %10s %10s %8s\n", "set", "accesses",
+         "misses", "compulsory", "capacity", "conflict", "miss%");
+  for (size_t k = 0; k < S && k < REPORT_SHOWN && sets[k].misses > 0; k++) {
+    set_report_t* r = &sets[k];
+    printf("%8d %10lld %10lld %10lld %10lld %10lld %7.2f%%\n", r->set, r->accesses, r->misses,
+           r->compulsory, r->capacity, r->conflict, 100.0 * r->misses / r->accesses);
+  }
+
+  // pack the used slots to the front before sorting them
+  size_t used = 0;
+  for (size_t h = 0; h < hsize; h++) {
+    if (blocks[h].last != 0) {
+      blocks[used++] = blocks[h];
+    }
   }
-  // increment time for all
-  for (int i = 0; i < cache->E; i++) {
-    // add to time first; for all lines
-    set->lines[i].time++;
+  qsort(blocks, used, sizeof(block_report_t), compare_block_reports);
+  printf("\nblocks missing most:\n%-18s %8s %10s %10s %10s %10s\n", "address", "set",
+         "accesses", "misses", "capacity", "conflict");
+  for (size_t k = 0; k < used && k < REPORT_SHOWN && blocks[k].misses > 0; k++) {
+    block_report_t* r = &blocks[k];
+    printf("0x%-16llx %8llu %10lld %10lld %10lld %10lld\n", r->block << config->b,
+           r->block & (S - 1), r->accesses, r->misses, r->capacity, r->conflict);
   }
+  printf("\nper-set counts written to %s\n", config->report);
 
-  // Search for hit
+  cache_free(cache);
+  free(ops);
+  free(sets);
+  free(blocks);
+  free(tree);
+}
+
+/**
+ * Hierarchy mode
+ *
+ * Models a data cache hierarchy (L1D, L2, LLC, ...) of write-back,
+ * write-allocate LRU caches with one block size. An access probes the
+ * levels from L1 down, paying each level's latency, until one hits or it
+ * falls through to memory; the block is then filled into the levels above.
+ * Where blocks and victims go depends on the inclusion policy:
+ *
+ *   inclusive  a block in a level is also in every level below it, so a
+ *              victim of a lower level is back-invalidated above it
+ *   exclusive  a block lives in one level only: a hit below L1 moves the
+ *              block up to L1, and victims move down one level
+ *   nine       fills go to every level above the hit, as for inclusive,
+ *              but nothing is back-invalidated (non-inclusive
+ *              non-exclusive, as in most L2s)
+ *
+ * Stores only mark the L1 line dirty. A dirty victim is written back to
+ * the next level (allocating it there if needed) or to memory. AMAT is
+ * the latency of all accesses over their number.
+ */
+#define MAX_LEVELS 8
+#define MEM_LATENCY 100 // cycles, unless -L gives one
+
+enum inclusion { NINE, INCLUSIVE, EXCLUSIVE };
+
+typedef struct level_stats {
+  long long hits;
+  long long misses;
+  long long evictions;
+  long long writebacks;         // dirty victims sent down
+  long long back_invalidations; // lines dropped to keep the levels inclusive
+} level_stats_t;
+
+typedef struct hierarchy {
+  int n;                        // number of levels
+  cache_t* level[MAX_LEVELS];   // level[0] is L1
+  int latency[MAX_LEVELS];      // cycles to probe each level
+  int mem_latency;
+  enum inclusion inclusion;
+  level_stats_t stats[MAX_LEVELS];
+  long long accesses;
+  long long cycles;             // total latency of all accesses
+  long long mem_reads;
+  long long mem_writes;
+} hierarchy_t;
+
+// the line (set * E + way) holding the block of addr, or -1
+static long level_find(cache_t* c, unsigned long long addr) {
+  size_t set = (addr >> c->b) & (c->S - 1);
+  size_t first = set * c->E;
+  int i = c->search(c->tags + first, c->valid + first, c->E, addr >> (c->s + c->b));
+  return (i < 0) ? -1 : (long)(first + i);
+}
+
+// drop a line, making it the next victim of its set
+static void level_invalidate(cache_t* c, long line) {
+  c->valid[line] = 0;
+  c->dirty[line] = 0;
+  cache_demote(c, line / c->E, line % c->E);
+}
+
+static void level_install(hierarchy_t* h, int j, unsigned long long addr, int dirty);
+
+// a dirty block leaves level j for the level below it, or memory
+static void write_back(hierarchy_t* h, int j, unsigned long long addr) {
+  h->stats[j].writebacks++;
+  if (j + 1 == h->n) {
+    h->mem_writes++;
+    return;
+  }
+  long line = level_find(h->level[j + 1], addr);
+  if (line >= 0) {
+    h->level[j + 1]->dirty[line] = 1;
+  } else {
+    level_install(h, j + 1, addr, 1);
+  }
+}
 
-  // flag to indicate if hit
-  int hit = 0;
-  for (int i = 0; i < cache->E; i++) {
-    // search for the tag
-    if (set->lines[i].valid && set->lines[i].tag == tag) {
-      // successfully hit
-      hit = 1;
-      // reset time
-      set->lines[i].time = 0;
-      // print if verbose
-      if (config->verbose) {
-        printf(" hit ");
+// make the block of addr the most recently used line of level j, moving
+// the victim it replaces according to the inclusion policy
+static void level_install(hierarchy_t* h, int j, unsigned long long addr, int dirty) {
+  cache_t* c = h->level[j];
+  size_t set = (addr >> c->b) & (c->S - 1);
+  unsigned int way = c->lru[set];
+  long line = set * c->E + way;
+
+  if (c->valid[line]) {
+    unsigned long long victim = (c->tags[line] << (c->s + c->b)) | (set << c->b);
+    int victim_dirty = c->dirty[line];
+    h->stats[j].evictions++;
+    // the line is free before anything below can come back up to this level
+    c->valid[line] = 0;
+    if (h->inclusion == INCLUSIVE) {
+      // the levels above cannot keep a block this level dropped
+      for (int u = 0; u < j; u++) {
+        long l = level_find(h->level[u], victim);
+        if (l >= 0) {
+          victim_dirty |= h->level[u]->dirty[l];
+          level_invalidate(h->level[u], l);
+          h->stats[u].back_invalidations++;
+        }
       }
-      hits++;
-      // stop searching
+    }
+    if (h->inclusion == EXCLUSIVE && j + 1 < h->n) {
+      // clean victims move down too, so the next level acts as a victim cache
+      h->stats[j].writebacks += victim_dirty;
+      level_install(h, j + 1, victim, victim_dirty);
+    } else if (victim_dirty) {
+      write_back(h, j, victim);
+    }
+  }
+  c->valid[line] = 1;
+  c->dirty[line] = dirty;
+  c->tags[line] = addr >> (c->s + c->b);
+  cache_touch(c, set, way);
+}
+
+// one load (write = 0) or store (write = 1) through the hierarchy
+void hierarchy_access(hierarchy_t* h, unsigned long long addr, int write) {
+  int j;
+  long line = -1;
+  h->accesses++;
+  for (j = 0; j < h->n; j++) {
+    h->cycles += h->latency[j];
+    if ((line = level_find(h->level[j], addr)) >= 0) {
       break;
     }
+    h->stats[j].misses++;
   }
 
-  // Handle miss
-  if (!hit) {
-    // print if verbose
-    if (config->verbose) {
-      printf(" miss ");
+  int dirty = 0;
+  if (j == h->n) {
+    h->cycles += h->mem_latency;
+    h->mem_reads++;
+  } else {
+    cache_t* c = h->level[j];
+    h->stats[j].hits++;
+    if (j == 0) {
+      cache_touch(c, line / c->E, line % c->E);
+      c->dirty[line] |= write;
+      return;
     }
-    misses++;
-    int placed = 0;
-    for (int i = 0; i < cache->E; i++) {
-      // search for an invalid line (empty) and place it there
-      if (!set->lines[i].valid) {
-        set->lines[i].valid = 1;
-        set->lines[i].tag = tag;
-        // reset time for placing at empty slot
-        set->lines[i].time = 0;
-        placed = 1;
-        break;
+    if (h->inclusion == EXCLUSIVE) {
+      // the block moves up to L1 and takes its dirty bit along
+      dirty = c->dirty[line];
+      level_invalidate(c, line);
+    } else {
+      cache_touch(c, line / c->E, line % c->E);
+    }
+  }
+
+  // fill the levels above the one that had the block, from the bottom up
+  if (h->inclusion == EXCLUSIVE) {
+    level_install(h, 0, addr, dirty | write);
+  } else {
+    for (int u = j - 1; u >= 0; u--) {
+      level_install(h, u, addr, u == 0 && write);
+    }
+  }
+}
+
+// parse -L into the levels of h; returns 0, or -1 if it is malformed
+int parse_levels(cache_config_t* config, hierarchy_t* h) {
+  const char* spec = config->levels;
+  h->mem_latency = MEM_LATENCY;
+  while (*spec) {
+    int s, E, latency, used;
+    if (sscanf(spec, "%d:%d:%d%n", &s, &E, &latency, &used) == 3) {
+      if (h->n == MAX_LEVELS || s < 0 || s > 30 || E <= 0 || latency < 0 ||
+          s + config->b > 63) {
+        return -1;
       }
+      h->level[h->n] = cache_init(s, E, config->b, config->kernel, LRU);
+      if (h->level[h->n] == NULL) {
+        return -1;
+      }
+      h->latency[h->n++] = latency;
+    } else if (sscanf(spec, "%d%n", &latency, &used) == 1 && latency >= 0 &&
+               (spec[used] == '\0')) {
+      // a bare number, last, is the memory latency
+      h->mem_latency = latency;
+    } else {
+      return -1;
+    }
+    spec += used;
+    if (*spec == ',') {
+      spec++;
+    } else if (*spec != '\0') {
+      return -1;
+    }
+  }
+  return (h->n > 0) ? 0 : -1;
+}
+
+// hierarchy mode: replay the trace through the levels of -L
+void hierarchy_simulate(cache_config_t* config) {
+  static const char* policies[] = {"nine", "inclusive", "exclusive"};
+  hierarchy_t h;
+  memset(&h, 0, sizeof(h));
+  if (config->inclusion != NULL) {
+    int p = 0;
+    while (p < 3 && strcmp(config->inclusion, policies[p]) != 0) {
+      p++;
+    }
+    if (p == 3) {
+      printf("Error: -I must be inclusive, exclusive or nine\n");
+      exit(1);
+    }
+    h.inclusion = p;
+  }
+  if (parse_levels(config, &h) < 0) {
+    printf("Error: bad hierarchy '%s' (up to %d levels of s:E:latency, then the "
+           "memory latency)\n",
+           config->levels, MAX_LEVELS);
+    exit(1);
+  }
+
+  ctrace_reader_t trace;
+  char operation;
+  unsigned long long address;
+  int size;
+  open_trace_file(&trace, config->tracefile);
+  while (ctrace_next(&trace, &operation, &address, &size)) {
+    // instruction fetches do not go through the data caches
+    if (operation == 'L' || operation == 'M') {
+      hierarchy_access(&h, address, 0);
     }
+    if (operation == 'S' || operation == 'M') {
+      hierarchy_access(&h, address, 1);
+    }
+  }
+  ctrace_close(&trace);
+
+  printf("%-6s %4s %6s %10s %7s %10s %10s %10s %10s %10s %8s\n", "level", "s", "E",
+         "size(B)", "cycles", "hits", "misses", "evictions", "writebacks", "backinval",
+         "miss%");
+  for (int j = 0; j < h.n; j++) {
+    cache_t* c = h.level[j];
+    level_stats_t* st = &h.stats[j];
+    long long probes = st->hits + st->misses;
+    printf("L%-5d %4d %6d %10llu %7d %10lld %10lld %10lld %10lld %10lld %7.2f%%\n", j + 1,
+           c->s, c->E, (unsigned long long)c->S * c->E * c->B, h.latency[j], st->hits,
+           st->misses, st->evictions, st->writebacks, st->back_invalidations,
+           probes ? 100.0 * st->misses / probes : 0.0);
+    cache_free(c);
+  }
+  printf("%-6s %4s %6s %10s %7d %10s %10lld reads, %lld writes\n", "memory", "", "", "",
+         h.mem_latency, "", h.mem_reads, h.mem_writes);
+  printf("AMAT: %.2f cycles over %lld accesses (%s, %d-byte blocks)\n",
+         h.accesses ? (double)h.cycles / h.accesses : 0.0, h.accesses,
+         policies[h.inclusion], 1 << config->b);
+}
+
+/**
+ * Coherence mode
+ *
+ * Each thread of a thread-tagged trace runs on its own core with a
+ * private LRU L1 (the -s/-E/-b geometry). The L1s snoop each other, as on
+ * a bus, and keep every line in one of the MESI states (plus Owned for
+ * MOESI). Misses not served by another L1 go to a shared LRU last level
+ * cache, and from there to memory.
+ *
+ *   read miss   another core's Modified copy supplies the data and drops
+ *               to Shared (MESI, writing the line back to the LLC) or to
+ *               Owned (MOESI, keeping it dirty); an Owned copy supplies
+ *               it and stays Owned; Exclusive copies drop to Shared. We
+ *               get Shared, or Exclusive if nobody else had the line.
+ *   write       a miss (read for ownership) or a hit in Shared/Owned
+ *               (upgrade) invalidates every other copy; we end Modified.
+ *               Exclusive becomes Modified silently.
+ *   eviction    Modified and Owned lines are written back to the LLC.
+ *
+ * A miss on a line this core lost to another core's write is a coherence
+ * miss. For each such line we remember which bytes the invalidating core
+ * wrote since; a coherence miss that touches none of them is false
+ * sharing: the data this core wanted never changed, only its neighbours.
+ * Lines are ranked by false sharing misses to point at hotspots.
+ */
+#define MAX_CORES 64
+#define HOTSPOTS (1 << 16) // lines tracked for the hotspot report
+#define HOTSPOTS_SHOWN 10
+
+// line states; INVALIDATED is Invalid, but lost to another core's write
+enum coherence_state { INVALID, SHARED, EXCLUSIVE_STATE, OWNED, MODIFIED, INVALIDATED };
 
-    // If no empty slot, evict
-    if (!placed) {
-      // print if verbose
-      if (config->verbose) {
-        printf(" evict ");
+typedef struct core_stats {
+  long long hits;
+  long long misses;
+  long long coherence_misses;
+  long long evictions;
+  long long writebacks;
+} core_stats_t;
+
+// a line that has had copies invalidated
+typedef struct hotspot {
+  unsigned long long block;    // block number, 0 with no invalidations = empty
+  int writer;                  // core whose write last invalidated other copies
+  unsigned long long written;  // bytes it has written since, one bit per 1/64 block
+  long long invalidations;
+  long long coherence_misses;
+  long long false_sharing;
+} hotspot_t;
+
+typedef struct coherence {
+  int moesi;
+  int ncores;
+  int thread[MAX_CORES];            // thread id running on each core
+  cache_t* l1[MAX_CORES];
+  unsigned char* state[MAX_CORES];  // one per L1 line
+  core_stats_t stats[MAX_CORES];
+  cache_t* llc;
+  long long llc_hits;
+  long long llc_misses;
+  long long mem_writes;
+  long long invalidations;          // copies dropped for another core's write
+  long long upgrades;               // writes to Shared/Owned lines
+  long long transfers;              // misses served by another L1
+  hotspot_t* hotspots;
+  long long untracked;              // invalidations the hotspot table had no room for
+} coherence_t;
+
+// the core that runs thread, giving it one if it is new
+int coherence_core(coherence_t* co, cache_config_t* config, int thread) {
+  for (int c = 0; c < co->ncores; c++) {
+    if (co->thread[c] == thread) {
+      return c;
+    }
+  }
+  if (co->ncores == MAX_CORES) {
+    printf("Error: more than %d threads in the trace\n", MAX_CORES);
+    exit(1);
+  }
+  int c = co->ncores++;
+  co->thread[c] = thread;
+  co->l1[c] = cache_init(config->s, config->E, config->b, config->kernel, LRU);
+  if (co->l1[c] == NULL ||
+      (co->state[c] = calloc((size_t)co->l1[c]->S * co->l1[c]->E, 1)) == NULL) {
+    printf("Error! Coherence memory not allocated");
+    exit(EXIT_FAILURE);
+  }
+  return c;
+}
+
+// the hotspot entry of block; NULL if it has none and create is 0 or the
+// table is full
+hotspot_t* hotspot_find(coherence_t* co, unsigned long long block, int create) {
+  size_t h = (block * 0x9E3779B97F4A7C15ULL) >> 40 & (HOTSPOTS - 1);
+  for (size_t probes = 0; probes < HOTSPOTS; probes++) {
+    hotspot_t* spot = &co->hotspots[h];
+    if (spot->invalidations == 0) {
+      if (!create) {
+        return NULL;
       }
-      evictions++;
-
-      // do LRU and replace the highest time; oldest line
-      int max_idx = -1;
-      int max_time = 0;
-      for (int i = 0; i < cache->E; i++) {
-        if (set->lines[i].time > max_time) {
-          max_time = set->lines[i].time;
-          max_idx = i;
+      spot->block = block;
+      return spot;
+    }
+    if (spot->block == block) {
+      return spot;
+    }
+    h = (h + 1) & (HOTSPOTS - 1);
+  }
+  return NULL;
+}
+
+// the bytes [address, address + size) of its block, one bit per 1/64 block
+unsigned long long byte_mask(int b, unsigned long long address, int size) {
+  int shift = (b > 6) ? b - 6 : 0;
+  unsigned long long offset = address & ((1ULL << b) - 1);
+  unsigned long long last = offset + (size > 0 ? size : 1) - 1;
+  if (last >> b) {
+    last = (1ULL << b) - 1; // an access that spills into the next block
+  }
+  unsigned int lo = offset >> shift, hi = last >> shift;
+  unsigned long long upto = (hi == 63) ? ~0ULL : (1ULL << (hi + 1)) - 1;
+  return upto & ~((1ULL << lo) - 1);
+}
+
+// read the block of address from the LLC, filling it from memory on a miss
+void llc_access(coherence_t* co, unsigned long long address, int writeback) {
+  cache_t* c = co->llc;
+  long line = level_find(c, address);
+  if (line < 0) {
+    if (!writeback) {
+      co->llc_misses++;
+    }
+    size_t set = (address >> c->b) & (c->S - 1);
+    line = set * c->E + c->lru[set];
+    if (c->valid[line] && c->dirty[line]) {
+      co->mem_writes++;
+    }
+    c->valid[line] = 1;
+    c->dirty[line] = 0;
+    c->tags[line] = address >> (c->s + c->b);
+  } else if (!writeback) {
+    co->llc_hits++;
+  }
+  c->dirty[line] |= writeback;
+  cache_touch(c, line / c->E, line % c->E);
+}
+
+// drop every other core's copy of address for a write by core
+int invalidate_others(coherence_t* co, int core, unsigned long long address) {
+  int dropped = 0;
+  for (int d = 0; d < co->ncores; d++) {
+    long line;
+    if (d == core || (line = level_find(co->l1[d], address)) < 0) {
+      continue;
+    }
+    level_invalidate(co->l1[d], line);
+    co->state[d][line] = INVALIDATED;
+    dropped++;
+  }
+  co->invalidations += dropped;
+  return dropped;
+}
+
+// one load (write = 0) or store (write = 1) of size bytes by thread
+void coherence_access(coherence_t* co, cache_config_t* config, int thread,
+                      unsigned long long address, int size, int write) {
+  int core = coherence_core(co, config, thread);
+  cache_t* l1 = co->l1[core];
+  unsigned char* state = co->state[core];
+  core_stats_t* st = &co->stats[core];
+  unsigned long long block = address >> l1->b;
+  unsigned long long mask = byte_mask(l1->b, address, size);
+  long line = level_find(l1, address);
+
+  if (line >= 0) {
+    st->hits++;
+    cache_touch(l1, line / l1->E, line % l1->E);
+    if (write) {
+      if (state[line] == SHARED || state[line] == OWNED) {
+        co->upgrades++;
+        if (invalidate_others(co, core, address) > 0) {
+          hotspot_t* spot = hotspot_find(co, block, 1);
+          if (spot == NULL) {
+            co->untracked++;
+          } else {
+            spot->invalidations++;
+            spot->writer = core;
+            spot->written = mask;
+          }
         }
+      } else {
+        // a line we own: remember the bytes, for false sharing
+        hotspot_t* spot = hotspot_find(co, block, 0);
+        if (spot != NULL && spot->writer == core) {
+          spot->written |= mask;
+        }
+      }
+      state[line] = MODIFIED;
+    }
+    return;
+  }
+
+  // miss: did another core's write take the line from us?
+  st->misses++;
+  size_t set = block & (l1->S - 1);
+  unsigned long long tag = address >> (l1->s + l1->b);
+  for (int i = 0; i < l1->E; i++) {
+    size_t l = set * l1->E + i;
+    if (state[l] == INVALIDATED && l1->tags[l] == tag) {
+      st->coherence_misses++;
+      state[l] = INVALID;
+      hotspot_t* spot = hotspot_find(co, block, 0);
+      if (spot != NULL) {
+        spot->coherence_misses++;
+        spot->false_sharing += (spot->writer != core && (spot->written & mask) == 0);
+      }
+      break;
+    }
+  }
+
+  // snoop the other L1s
+  int shared = 0, supplied = 0;
+  if (write) {
+    for (int d = 0; d < co->ncores; d++) {
+      long l;
+      if (d != core && (l = level_find(co->l1[d], address)) >= 0) {
+        supplied |= co->state[d][l] == MODIFIED || co->state[d][l] == OWNED;
+      }
+    }
+    if (invalidate_others(co, core, address) > 0) {
+      hotspot_t* spot = hotspot_find(co, block, 1);
+      if (spot == NULL) {
+        co->untracked++;
+      } else {
+        spot->invalidations++;
+        spot->writer = core;
+        spot->written = mask;
+      }
+    }
+  } else {
+    for (int d = 0; d < co->ncores; d++) {
+      long l;
+      if (d == core || (l = level_find(co->l1[d], address)) < 0) {
+        continue;
       }
-      if (max_idx != -1) {
-        // evict accordingly by replacing tag
-        set->lines[max_idx].tag = tag;
-        // reset time
-        set->lines[max_idx].time = 0;
+      shared = 1;
+      unsigned char* other = &co->state[d][l];
+      if (*other == MODIFIED) {
+        supplied = 1;
+        if (co->moesi) {
+          *other = OWNED;
+        } else {
+          *other = SHARED;
+          co->stats[d].writebacks++;
+          llc_access(co, address, 1);
+        }
+      } else if (*other == OWNED) {
+        supplied = 1;
       } else {
-        perror("Error, LRU eviction did not work");
+        *other = SHARED;
       }
     }
-  };
-  // Modify operation ('M' means load + store, so always an extra hit)
-  // else its just the same as before
-  if (operation == 'M') {
-    // print if verbose
-    if (config->verbose) {
-      printf(" hit_m ");
+  }
+  if (supplied) {
+    co->transfers++;
+  } else {
+    llc_access(co, address, 0);
+  }
+
+  // fill our L1, writing back a dirty victim
+  size_t victim = set * l1->E + l1->lru[set];
+  if (l1->valid[victim]) {
+    st->evictions++;
+    if (state[victim] == MODIFIED || state[victim] == OWNED) {
+      st->writebacks++;
+      llc_access(co, (l1->tags[victim] << (l1->s + l1->b)) | (set << l1->b), 1);
     }
-    hits++;
   }
+  l1->valid[victim] = 1;
+  l1->tags[victim] = tag;
+  state[victim] = write ? MODIFIED : shared ? SHARED : EXCLUSIVE_STATE;
+  cache_touch(l1, set, victim % l1->E);
 }
 
-void print_usage(char* prog_name) {
-  printf("Usage: %s [-hv] -s <s> -E <E> -b <b> -t <tracefile>\n", prog_name);
-  printf("  -h  : Print this help message\n");
-  printf("  -v  : Enable verbose output\n");
-  printf("  -s <s> : Number of set index bits (S = 2^s is the number of sets)\n");
-  printf("  -E <E> : Number of lines per set (associativity)\n");
-  printf("  -b <b> : Number of block bits (B = 2^b is the block size)\n");
-  printf("  -t <tracefile> : Path to the valgrind trace file\n");
+// order hotspots by false sharing, then coherence misses, then invalidations
+int compare_hotspots(const void* a, const void* b) {
+  const hotspot_t* x = a;
+  const hotspot_t* y = b;
+  if (x->false_sharing != y->false_sharing) {
+    return (x->false_sharing < y->false_sharing) ? 1 : -1;
+  }
+  if (x->coherence_misses != y->coherence_misses) {
+    return (x->coherence_misses < y->coherence_misses) ? 1 : -1;
+  }
+  return (x->invalidations < y->invalidations) ? 1 : (x->invalidations > y->invalidations);
 }
 
-// modify the config object accordingly, returns nothing
-void parse_arguments(int argc, char** argv, cache_config_t* config) {
-  int opt;
-  while ((opt = getopt(argc, argv, "hvs:E:b:t:")) != -1) {
-    switch (opt) {
-    case 'h':
-      print_usage(argv[0]);
-      exit(0);
-    case 'v':
-      config->verbose = 1;
-      break;
-    case 's':
-      config->s = atoi(optarg);
-      break;
-    case 'E':
-      config->E = atoi(optarg);
-      break;
-    case 'b':
-      config->b = atoi(optarg);
-      break;
-    case 't':
-      config->tracefile = optarg;
-      break;
-    default:
-      print_usage(argv[0]);
-      exit(1);
+// coherence mode: replay a thread-tagged trace on one L1 per thread
+void coherence_simulate(cache_config_t* config) {
+  coherence_t* co = calloc(1, sizeof(coherence_t));
+  if (co == NULL || (co->hotspots = calloc(HOTSPOTS, sizeof(hotspot_t))) == NULL) {
+    printf("Error! Coherence memory not allocated");
+    exit(EXIT_FAILURE);
+  }
+  if (strcmp(config->protocol, "moesi") == 0) {
+    co->moesi = 1;
+  } else if (strcmp(config->protocol, "mesi") != 0) {
+    printf("Error: -C must be mesi or moesi\n");
+    exit(1);
+  }
+  int llc_s = config->s + 2, llc_E = config->E * 4;
+  if (config->llc != NULL && sscanf(config->llc, "%d:%d", &llc_s, &llc_E) != 2) {
+    llc_E = 0;
+  }
+  if (llc_s < 0 || llc_s > 30 || llc_E <= 0 || llc_s + config->b > 63 ||
+      (co->llc = cache_init(llc_s, llc_E, config->b, config->kernel, LRU)) == NULL) {
+    printf("Error: bad LLC geometry for -l (s:E)\n");
+    exit(1);
+  }
+
+  ctrace_reader_t trace;
+  char operation;
+  unsigned long long address;
+  int size;
+  open_trace_file(&trace, config->tracefile);
+  while (ctrace_next(&trace, &operation, &address, &size)) {
+    if (operation == 'L' || operation == 'M') {
+      coherence_access(co, config, trace.thread, address, size, 0);
+    }
+    if (operation == 'S' || operation == 'M') {
+      coherence_access(co, config, trace.thread, address, size, 1);
     }
   }
+  ctrace_close(&trace);
 
-  // Check if required arguments are provided
-  if (config->s == 0 || config->E == 0 || config->b == 0 || config->tracefile == NULL) {
-    printf("Error: Missing required arguments\n");
-    print_usage(argv[0]);
-    exit(1);
+  printf("%-5s %7s %10s %10s %10s %10s %10s %8s\n", "core", "thread", "hits", "misses",
+         "coherence", "evictions", "writebacks", "miss%");
+  for (int c = 0; c < co->ncores; c++) {
+    core_stats_t* st = &co->stats[c];
+    long long accesses = st->hits + st->misses;
+    printf("%-5d %7d %10lld %10lld %10lld %10lld %10lld %7.2f%%\n", c, co->thread[c],
+           st->hits, st->misses, st->coherence_misses, st->evictions, st->writebacks,
+           accesses ? 100.0 * st->misses / accesses : 0.0);
+  }
+  printf("LLC (s=%d, E=%d): hits %lld, misses %lld, memory writebacks %lld\n", llc_s, llc_E,
+         co->llc_hits, co->llc_misses, co->mem_writes);
+  printf("%s: invalidations %lld, upgrades %lld, cache-to-cache transfers %lld\n",
+         co->moesi ? "MOESI" : "MESI", co->invalidations, co->upgrades, co->transfers);
+
+  qsort(co->hotspots, HOTSPOTS, sizeof(hotspot_t), compare_hotspots);
+  if (co->hotspots[0].invalidations > 0) {
+    printf("\nmost contended lines:\n%-18s %13s %10s %14s\n", "address", "invalidations",
+           "coherence", "false sharing");
+    for (int k = 0; k < HOTSPOTS_SHOWN && co->hotspots[k].invalidations > 0; k++) {
+      hotspot_t* spot = &co->hotspots[k];
+      printf("0x%-16llx %13lld %10lld %14lld\n", spot->block << config->b,
+             spot->invalidations, spot->coherence_misses, spot->false_sharing);
+    }
+  }
+  if (co->untracked > 0) {
+    printf("(%lld invalidations on lines past the first %d were not tracked)\n", co->untracked,
+           HOTSPOTS);
+  }
+
+  for (int c = 0; c < co->ncores; c++) {
+    cache_free(co->l1[c]);
+    free(co->state[c]);
   }
+  cache_free(co->llc);
+  free(co->hotspots);
+  free(co);
 }
 
-void parse_trace_file(cache_t* cache, cache_config_t* config) {
-  FILE* file = fopen(config->tracefile, "r");
-  if (!file) {
-    perror("Error opening trace file");
+/**
+ * Sharded mode
+ *
+ * Sets never interact, so one cache can be simulated by several threads
+ * at once, each owning some of its sets. With -j n the sets are split
+ * into n contiguous ranges (shards). The main thread decodes the trace and
+ * routes each access to the queue of the shard owning its set; a worker
+ * per shard replays its queue against the shared cache arrays, counting
+ * into its own copy of the cache struct. Each set still sees its accesses
+ * in trace order, so the counts, summed over the shards at the end, are
+ * exactly those of the serial run.
+ *
+ * The queues are single-producer single-consumer rings: only the decoder
+ * writes tail and only the worker writes head, so they need no lock, just
+ * release stores and acquire loads of the two indices. The decoder only
+ * rereads head when the ring looks full.
+ *
+ * Random and brrip draw from one random number generator for all sets,
+ * and prefetchers fill sets other than the one accessed, so with them
+ * the results would depend on thread timing; they are not sharded.
+ */
+#define SHARD_QUEUE (1 << 14) // accesses per shard queue, a power of 2
+
+typedef struct shard {
+  cache_t cache;          // the shared cache arrays, with this shard's counters
+  trace_op_t* ring;
+  int done;               // set by the decoder after the last access
+  // written by the decoder; on its own host cache line
+  size_t tail __attribute__((aligned(CACHE_ALIGN)));
+  size_t head_seen;       // the decoder's last look at head
+  // written by the worker
+  size_t head __attribute__((aligned(CACHE_ALIGN)));
+} shard_t;
+
+// decoder: queue one access for a shard, waiting while its ring is full
+static void shard_push(shard_t* sh, char operation, unsigned long long address) {
+  size_t tail = __atomic_load_n(&sh->tail, __ATOMIC_RELAXED);
+  while (tail - sh->head_seen == SHARD_QUEUE) {
+    sh->head_seen = __atomic_load_n(&sh->head, __ATOMIC_ACQUIRE);
+    if (tail - sh->head_seen == SHARD_QUEUE) {
+      sched_yield();
+    }
+  }
+  trace_op_t* op = &sh->ring[tail & (SHARD_QUEUE - 1)];
+  op->operation = operation;
+  op->address = address;
+  __atomic_store_n(&sh->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// worker thread: replay the shard's queue until the decoder is done
+void* shard_worker(void* arg) {
+  shard_t* sh = arg;
+  size_t head = 0;
+  for (;;) {
+    // done before tail: once done is seen, tail is final
+    int done = __atomic_load_n(&sh->done, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&sh->tail, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+      if (done) {
+        return NULL;
+      }
+      sched_yield();
+      continue;
+    }
+    // replay everything queued, in at most two runs if it wraps around
+    while (head != tail) {
+      size_t at = head & (SHARD_QUEUE - 1);
+      size_t n = (tail - head < SHARD_QUEUE - at) ? tail - head : SHARD_QUEUE - at;
+      cache_simulate_batch(&sh->cache, sh->ring + at, n);
+      head += n;
+      __atomic_store_n(&sh->head, head, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+// sharded mode: simulate one cache with its sets split among -j threads
+void shard_simulate(cache_config_t* config) {
+  if (config->verbose || config->prefetch != NULL || config->policy == RANDOM ||
+      config->policy == BRRIP) {
+    printf("Error: -j cannot split the sets with -v, -F, random or brrip\n");
+    exit(1);
+  }
+  cache_t* cache = config_cache_or_die(config);
+  int nshards = (config->jobs < cache->S) ? config->jobs : cache->S;
+  shard_t* shards;
+  if (posix_memalign((void**)&shards, CACHE_ALIGN, nshards * sizeof(shard_t)) != 0) {
+    printf("Error! Shard memory not allocated");
     exit(EXIT_FAILURE);
   }
+  pthread_t* workers = malloc(nshards * sizeof(pthread_t));
+  for (int w = 0; w < nshards; w++) {
+    shard_t* sh = &shards[w];
+    memset(sh, 0, sizeof(shard_t));
+    sh->cache = *cache;
+    sh->ring = malloc(SHARD_QUEUE * sizeof(trace_op_t));
+    if (workers == NULL || sh->ring == NULL) {
+      printf("Error! Shard memory not allocated");
+      exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&workers[w], NULL, shard_worker, sh) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  char line[256];
-  while (fgets(line, sizeof(line), file)) {
-    char operation;
-    unsigned long long address;
-    int size;
-    //%c means read a single character
-    // leading whitespace skips all white spaces
-    //%lx reads a hex number and stores it as unsigned long
-    // ,%d ensures , must appear and %d reads an integer
-    if (sscanf(line, " %c %llx,%d", &operation, &address, &size) == 3) {
-      printf("\nOperation: %c, Address: 0x%llx, Value: %d", operation, address, size);
-      // do the cache simulation
-      cache_simulate(cache, config, operation, address);
+  // decode on this thread; shard w owns sets [w * S / n, (w + 1) * S / n)
+  ctrace_reader_t trace;
+  char operation;
+  unsigned long long address;
+  int size;
+  open_trace_file(&trace, config->tracefile);
+  while (ctrace_next(&trace, &operation, &address, &size)) {
+    if (operation != 'I') {
+      unsigned long long set = (address >> config->b) & (cache->S - 1);
+      shard_push(&shards[(set * nshards) >> config->s], operation, address);
     }
-  };
-  fclose(file);
+  }
+  ctrace_close(&trace);
+  for (int w = 0; w < nshards; w++) {
+    __atomic_store_n(&shards[w].done, 1, __ATOMIC_RELEASE);
+  }
+
+  // reduce the per-shard counters
+  for (int w = 0; w < nshards; w++) {
+    pthread_join(workers[w], NULL);
+    cache->hits += shards[w].cache.hits;
+    cache->misses += shards[w].cache.misses;
+    cache->evictions += shards[w].cache.evictions;
+    free(shards[w].ring);
+  }
+  printSummary((int)cache->hits, (int)cache->misses, (int)cache->evictions);
+  free(workers);
+  free(shards);
+  cache_free(cache);
 }
 
 int main(int argc, char** argv) {
-  cache_config_t config = {0, 0, 0, NULL, 0}; // Initialize with defaults
+  cache_config_t config = {-1, 0, -1, NULL, 0}; // Initialize with defaults
   parse_arguments(argc, argv, &config);
 
+  // only grid mode and the plain simulation (as shards) run on threads
+  if (config.jobs > 1 && config.grid == NULL &&
+      (config.distance || config.report != NULL || config.levels != NULL ||
+       config.protocol != NULL || config.bench > 0)) {
+    printf("Error: -j cannot be used with -D, -R, -L, -C or -B\n");
+    exit(1);
+  }
+  if (config.grid != NULL) {
+    grid_simulate(&config);
+    return 0;
+  }
+  if (config.distance) {
+    stack_distance_analysis(&config);
+    return 0;
+  }
+  if (config.report != NULL) {
+    miss_report(&config);
+    return 0;
+  }
+  if (config.levels != NULL) {
+    hierarchy_simulate(&config);
+    return 0;
+  }
+  if (config.protocol != NULL) {
+    coherence_simulate(&config);
+    return 0;
+  }
+  if (config.bench > 0) {
+    config.verbose = 0;
+    benchmark(&config);
+    return 0;
+  }
+  if (config.jobs > 1) {
+    shard_simulate(&config);
+    return 0;
+  }
+
   // Print parsed arguments (for debugging)
   if (config.verbose) {
     printf("Verbose mode enabled\n");
@@ -331,13 +1694,19 @@ int main(int argc, char** argv) {
            config.tracefile);
   }
   // create the cache
-  cache_t* full_cache = cache_init(config.s, config.E, config.b);
+  cache_t* full_cache = config_cache_or_die(&config);
   // do the full simulation
   parse_trace_file(full_cache, &config);
 
   // print out the final results
-  printf("\n");
-  printSummary(hits, misses, evictions);
+  if (config.verbose) {
+    printf("\n");
+  }
+  printSummary((int)full_cache->hits, (int)full_cache->misses, (int)full_cache->evictions);
+  if (full_cache->prefetcher != NULL) {
+    print_prefetch_stats(full_cache);
+  }
 
+  cache_free(full_cache);
   return 0;
 };
\ No newline at end of file
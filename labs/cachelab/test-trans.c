@@ -2,7 +2,16 @@
  * test-trans.c - Checks the correctness and performance of all of the
  *     student's transpose functions and records the results for their
  *     official submitted version as well.
+ *
+ * By default each function is traced with valgrind, and the trace is
+ * filtered and simulated as it streams in. With -i, tracegen-sim simulates each function
+ * in-process instead, in milliseconds rather than seconds. Either way
+ * the functions are evaluated -j at a time, each by its own tracegen
+ * with its own pipe and marker file, and reported in registration order.
  */
+/* for popen under -std=c99 */
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -11,13 +20,20 @@
 #include <signal.h>
 #include <getopt.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include "cachelab.h"
+#include "cachesim.h"
+#include "cachetrace.h"
 #include <sys/wait.h> // fir WEXITSTATUS
 #include <limits.h> // for INT_MAX
 
 /* Maximum array dimension */
 #define MAXN 256
 
+/* Range around tracegen's stack address that counts as stack */
+#define STACK_BELOW (8 << 20)
+#define STACK_ABOVE (1 << 20)
+
 /* The description string for the transpose_submit() function that the
    student submits for credit */
 #define SUBMIT_DESCRIPTION "Transpose submission"
@@ -25,6 +41,10 @@
 /* External function defined in trans.c */
 extern void registerFunctions();
 
+/* External functions defined in trans-tuned.c and trans-simd.c */
+extern void registerTunedFunctions();
+extern void registerSimdFunctions();
+
 /* External variables defined in cachelab-tools.c */
 extern trans_func_t func_list[MAX_TRANS_FUNCS];
 extern int func_counter; 
@@ -32,56 +52,230 @@ extern int func_counter;
 /* Globals set on the command line */
 static int M = 0;
 static int N = 0;
+static int online = 0; /* -i: simulate in-process, without valgrind */
+static int jobs = 0;   /* -j: functions evaluated at once, 0 = one per CPU */
 
 /* The correctness and performance for the submitted transpose function */
 struct results {
     int funcid;
     int correct;
-    int misses;
+    long long misses;
 };
 static struct results results = {-1, 0, INT_MAX};
 
+/* The evaluation of one registered function */
+struct eval {
+    int flag;               /* 0, or tracegen's nonzero exit status */
+    long long hits;
+    long long misses;
+    long long evictions;
+};
+
+/* The pool of workers evaluating the registered functions */
+static struct {
+    int next;               /* next function to hand out */
+    pthread_mutex_t lock;   /* protects next */
+    unsigned int s, E, b;
+    struct eval evals[MAX_TRANS_FUNCS];
+} pool;
+
+/*
+ * eval_online - Validate function i and count its hits, misses and
+ *     evictions with tracegen-sim. Returns 0, or tracegen's nonzero exit
+ *     status if the function is incorrect or could not be run.
+ */
+int eval_online(int i, unsigned int s, unsigned int E, unsigned int b,
+                long long *hits, long long *misses, long long *evictions)
+{
+    char cmd[255], line[255];
+    int fn, counted = 0;
+
+    sprintf(cmd, "./tracegen-sim -M %d -N %d -F %d -s %u -E %u -b %u",
+            M, N, i, s, E, b);
+    FILE *fp = popen(cmd, "r");
+    assert(fp);
+    while (fgets(line, sizeof(line), fp)) {
+        /* Anything else is a validation message, which the user is
+           told how to reproduce */
+        if (sscanf(line, "func %d: hits:%lld misses:%lld evictions:%lld",
+                   &fn, hits, misses, evictions) == 4 && fn == i)
+            counted = 1;
+    }
+    int status = pclose(fp);
+    if (status == -1 || !WIFEXITED(status))
+        return i+1;
+    if (WEXITSTATUS(status) == 0 && !counted)
+        return i+1;
+    return WEXITSTATUS(status);
+}
+
+/*
+ * read_markers - Read the marker addresses and the address of a local of
+ *     tracegen's main from the file tracegen writes before it runs the
+ *     function. Returns how many it read: 0 if the file is not there yet,
+ *     2 if it comes from a tracegen that records no stack address.
+ */
+int read_markers(const char *path, unsigned long long *start,
+                 unsigned long long *end, unsigned long long *stack)
+{
+    FILE* marker_fp = fopen(path, "r");
+    if (!marker_fp)
+        return 0;
+    int n = fscanf(marker_fp, "%llx %llx %llx", start, end, stack);
+    fclose(marker_fp);
+    return (n < 0) ? 0 : n;
+}
+
+/*
+ * on_stack - Whether addr is a stack access. Valgrind creates many
+ *     spurious accesses to the stack that have nothing to do with the
+ *     student's code, and the locals of -O0 code live there as well, so
+ *     those are all dropped: anything within STACK_BELOW below and
+ *     STACK_ABOVE above the local of tracegen's main. Without that
+ *     address we fall back to keeping the low 32-bit portion of the
+ *     address space only.
+ */
+int on_stack(unsigned long long addr, int markers, unsigned long long stack)
+{
+    if (markers < 3)
+        return addr >= 0xffffffff;
+    return addr + STACK_BELOW >= stack && addr < stack + STACK_ABOVE;
+}
+
+/*
+ * eval_valgrind - Validate function i and count its hits, misses and
+ *     evictions in one pass over its valgrind trace. The trace is read
+ *     from a pipe as valgrind writes it, cut down on the fly to the
+ *     accesses between the markers that are not to the stack, and fed
+ *     straight into the cache. No trace is stored anywhere. Returns 0,
+ *     or tracegen's nonzero exit status if the function is incorrect.
+ */
+int eval_valgrind(int i, unsigned int s, unsigned int E, unsigned int b,
+                  long long *hits, long long *misses, long long *evictions)
+{
+    unsigned long long marker_start = 0, marker_end = 0, stack = 0, addr;
+    int len, markers = 0, inside = 0;
+    char op, cmd[255], marker[32];
+    ctrace_reader_t trace;
+
+    /* A marker file from an earlier run would point at the wrong place */
+    sprintf(marker, ".marker.%d", i);
+    unlink(marker);
+    sprintf(cmd, "valgrind --tool=lackey --trace-mem=yes --log-fd=1 -v ./tracegen -M %d -N %d -F %d -m %s", M, N, i, marker);
+    FILE *fp = popen(cmd, "r");
+    assert(fp);
+    cache_t *cache = cache_init(s, E, b, NULL, LRU);
+    assert(cache);
+    ctrace_fdopen(&trace, fileno(fp));
+
+    while (ctrace_next(&trace, &op, &addr, &len)) {
+
+        /* We are only interested in memory access instructions */
+        if (op!='S' && op!='M' && op!='L')
+            continue;
+
+        /* tracegen writes the marker file before its one byte store to
+           MARKER_START, so by the time that store comes down the pipe
+           the file is complete */
+        if (markers < 2 && op == 'S' && len == 1)
+            markers = read_markers(marker, &marker_start, &marker_end, &stack);
+
+        /* If start marker found, set flag */
+        if (markers >= 2 && addr == marker_start)
+            inside = 1;
+
+        if (inside && !on_stack(addr, markers, stack))
+            cache_simulate(cache, op, addr, len);
+
+        /* Past the end marker, read on so that tracegen can finish */
+        if (inside && addr == marker_end)
+            inside = 0;
+    }
+    ctrace_close(&trace);
+    int status = pclose(fp);
+    unlink(marker);
+
+    *hits = cache->hits;
+    *misses = cache->misses;
+    *evictions = cache->evictions;
+    cache_free(cache);
+    if (status == -1)
+        return i+1;
+    if (WEXITSTATUS(status) == 0)
+        assert(markers >= 2);
+    return WEXITSTATUS(status);
+}
+
+/*
+ * eval_worker - Evaluate registered functions until there are none left
+ */
+void *eval_worker(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        int i = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+        if (i >= func_counter)
+            return NULL;
+
+        struct eval *ev = &pool.evals[i];
+        if (online)
+            ev->flag = eval_online(i, pool.s, pool.E, pool.b,
+                                   &ev->hits, &ev->misses, &ev->evictions);
+        else
+            ev->flag = eval_valgrind(i, pool.s, pool.E, pool.b,
+                                     &ev->hits, &ev->misses, &ev->evictions);
+    }
+}
+
 /* 
  * eval_perf - Evaluate the performance of the registered transpose functions
  */
 void eval_perf(unsigned int s, unsigned int E, unsigned int b)
 {
-    int i,flag;
-    unsigned int len, hits, misses, evictions;
-    unsigned long long int marker_start, marker_end, addr;
-    char buf[1000], cmd[255];
-    char filename[128];
+    int i, t, nworkers;
+    pthread_t workers[MAX_TRANS_FUNCS];
 
     registerFunctions(); 
+    registerTunedFunctions();
+    registerSimdFunctions();
+
+    /* Evaluate the registered transpose functions, several at once */
+    pool.next = 0;
+    pool.s = s;
+    pool.E = E;
+    pool.b = b;
+    pthread_mutex_init(&pool.lock, NULL);
+    nworkers = (jobs > 0) ? jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > func_counter)
+        nworkers = func_counter;
+    if (nworkers < 1)
+        nworkers = 1;
+    printf("Evaluating %d functions %son %d workers (s=%d, E=%d, b=%d)\n",
+           func_counter, online ? "in-process " : "", nworkers, s, E, b);
+    fflush(stdout);
+    for (t = 0; t < nworkers; t++) {
+        if (pthread_create(&workers[t], NULL, eval_worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (t = 0; t < nworkers; t++)
+        pthread_join(workers[t], NULL);
+    pthread_mutex_destroy(&pool.lock);
 
-    /* Open the complete trace file */
-    FILE* full_trace_fp;  
-    FILE* part_trace_fp; 
-
-    /* Evaluate the performance of each registered transpose function */
-
+    /* Report them in registration order */
     for (i=0; i<func_counter; i++) {
+        struct eval *ev = &pool.evals[i];
         if (strcmp(func_list[i].description, SUBMIT_DESCRIPTION) == 0 )
             results.funcid = i; /* remember which function is the submission */
 
-
-        printf("\nFunction %d (%d total)\nStep 1: Validating and generating memory traces\n",i,func_counter);
-        /* Use valgrind to generate the trace */
-
-        sprintf(cmd, "valgrind --tool=lackey --trace-mem=yes --log-fd=1 -v ./tracegen -M %d -N %d -F %d  > trace.tmp", M, N,i);
-        flag=WEXITSTATUS(system(cmd));
-        if (0!=flag) {
-            printf("Validation error at function %d! Run ./tracegen -M %d -N %d -F %d for details.\nSkipping performance evaluation for this function.\n",flag-1,M,N,i);      
+        printf("\nFunction %d (%d total)\n", i, func_counter);
+        if (0!=ev->flag) {
+            printf("Validation error at function %d! Run ./tracegen -M %d -N %d -F %d for details.\nSkipping performance evaluation for this function.\n",ev->flag-1,M,N,i);      
             continue;
         }
 
-        /* Get the start and end marker addresses */
-        FILE* marker_fp = fopen(".marker", "r");
-        assert(marker_fp);
-        fscanf(marker_fp, "%llx %llx", &marker_start, &marker_end);
-        fclose(marker_fp);
-
-
         func_list[i].correct=1;
 
         /* Save the correctness of the transpose submission */
@@ -89,72 +283,15 @@ void eval_perf(unsigned int s, unsigned int E, unsigned int b)
             results.correct = 1;
         }
 
-        full_trace_fp = fopen("trace.tmp", "r");
-        assert(full_trace_fp);
-
-
-        /* Filtered trace for each transpose function goes in a separate file */
-        sprintf(filename, "trace.f%d", i);
-        part_trace_fp = fopen(filename, "w");
-        assert(part_trace_fp);
-    
-        /* Locate trace corresponding to the trans function */
-        flag = 0;
-        while (fgets(buf, 1000, full_trace_fp) != NULL) {
-
-            /* We are only interested in memory access instructions */
-            if (buf[0]==' ' && buf[2]==' ' &&
-                (buf[1]=='S' || buf[1]=='M' || buf[1]=='L' )) {
-                sscanf(buf+3, "%llx,%u", &addr, &len);
-        
-                /* If start marker found, set flag */
-                if (addr == marker_start)
-                    flag = 1;
-
-                /* Valgrind creates many spurious accesses to the
-                   stack that have nothing to do with the students
-                   code. At the moment, we are ignoring all stack
-                   accesses by using the simple filter of recording
-                   accesses to only the low 32-bit portion of the
-                   address space. At some point it would be nice to
-                   try to do more informed filtering so that would
-                   eliminate the valgrind stack references while
-                   include the student stack references. */
-                if (flag && addr < 0xffffffff) {
-                    fputs(buf, part_trace_fp);
-                }
-
-                /* if end marker found, close trace file */
-                if (addr == marker_end) {
-                    flag = 0;
-                    fclose(part_trace_fp);
-                    break;
-                }
-            }
-        }
-        fclose(full_trace_fp);
-
-        /* Run the reference simulator */
-        printf("Step 2: Evaluating performance (s=%d, E=%d, b=%d)\n", s, E, b);
-        char cmd[255];
-        sprintf(cmd, "./csim-ref -s %u -E %u -b %u -t trace.f%d > /dev/null", 
-                s, E, b, i);
-        system(cmd);
-    
-        /* Collect results from the reference simulator */
-        FILE* in_fp = fopen(".csim_results","r");
-        assert(in_fp);
-        fscanf(in_fp, "%u %u %u", &hits, &misses, &evictions);
-        fclose(in_fp);
-        func_list[i].num_hits = hits;
-        func_list[i].num_misses = misses;
-        func_list[i].num_evictions = evictions;
-        printf("func %u (%s): hits:%u, misses:%u, evictions:%u\n",
-               i, func_list[i].description, hits, misses, evictions);
+        func_list[i].num_hits = (unsigned int)ev->hits;
+        func_list[i].num_misses = (unsigned int)ev->misses;
+        func_list[i].num_evictions = (unsigned int)ev->evictions;
+        printf("func %u (%s): hits:%lld, misses:%lld, evictions:%lld\n",
+               i, func_list[i].description, ev->hits, ev->misses, ev->evictions);
     
         /* If it is transpose_submit(), record number of misses */
         if (results.funcid == i) {
-            results.misses = misses;
+            results.misses = ev->misses;
         }
     }
   
@@ -164,9 +301,11 @@ void eval_perf(unsigned int s, unsigned int E, unsigned int b)
  * usage - Print usage info
  */
 void usage(char *argv[]){
-    printf("Usage: %s [-h] -M <rows> -N <cols>\n", argv[0]);
+    printf("Usage: %s [-hi] [-j <n>] -M <rows> -N <cols>\n", argv[0]);
     printf("Options:\n");
     printf("  -h          Print this help message.\n");
+    printf("  -i          Simulate in-process with tracegen-sim, not valgrind.\n");
+    printf("  -j <n>      Evaluate n functions at once (default: one per CPU).\n");
     printf("  -M <rows>   Number of matrix rows (max %d)\n", MAXN);
     printf("  -N <cols>   Number of  matrix columns (max %d)\n", MAXN);
     printf("Example: %s -M 8 -N 8\n", argv[0]);       
@@ -199,7 +338,7 @@ int main(int argc, char* argv[])
 {
     char c;
 
-    while ((c = getopt(argc,argv,"M:N:h")) != -1) {
+    while ((c = getopt(argc,argv,"M:N:hij:")) != -1) {
         switch(c) {
         case 'M':
             M = atoi(optarg);
@@ -210,6 +349,12 @@ int main(int argc, char* argv[])
         case 'h':
             usage(argv);
             exit(0);
+        case 'i':
+            online = 1;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
         default:
             usage(argv);
             exit(1);
@@ -253,9 +398,9 @@ int main(int argc, char* argv[])
         printf("\nTEST_TRANS_RESULTS=0:0\n");
     }
     else {
-        printf("\nSummary for official submission (func %d): correctness=%d misses=%d\n",
+        printf("\nSummary for official submission (func %d): correctness=%d misses=%lld\n",
                results.funcid, results.correct, results.misses);
-        printf("\nTEST_TRANS_RESULTS=%d:%d\n", results.correct, results.misses);
+        printf("\nTEST_TRANS_RESULTS=%d:%lld\n", results.correct, results.misses);
     }
     return 0;
 }
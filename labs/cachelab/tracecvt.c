@@ -0,0 +1,164 @@
+/*
+ * tracecvt.c - Convert memory traces between the valgrind lackey text
+ *     format and the compact binary format of cachetrace.h.
+ *
+ * The input may be in either format. By default the output is binary;
+ * with -d it is lackey text, e.g. for feeding a binary trace to csim-ref.
+ * Thread ids survive the conversion either way. With -c the output is
+ * read back and checked against the input, record by record.
+ *
+ *   linux> valgrind --tool=lackey --trace-mem=yes --log-fd=1 ./prog > t.txt
+ *   linux> ./tracecvt t.txt t.ctr
+ *   linux> ./csim -s 5 -E 1 -b 5 -t t.ctr
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "cachetrace.h"
+
+/*
+ * usage - Print usage info
+ */
+void usage(char *argv[])
+{
+    printf("Usage: %s [-hdc] <infile> <outfile>\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h          Print this help message.\n");
+    printf("  -d          Write lackey text instead of the binary format.\n");
+    printf("  -c          Check that the output reads back as the input.\n");
+    printf("Example: %s traces/long.trace long.ctr\n", argv[0]);
+}
+
+/*
+ * check - Read the traces at inpath and outpath side by side and report
+ *     the first record (or thread) where they differ. Returns 0 if they
+ *     hold the same records.
+ */
+int check(const char *inpath, const char *outpath)
+{
+    ctrace_reader_t *a = malloc(sizeof(*a)), *b = malloc(sizeof(*b));
+    unsigned long long addr_a, addr_b, n = 0;
+    int size_a, size_b, more_a, more_b, rc = -1;
+    char op_a, op_b;
+
+    if (a == NULL || b == NULL || ctrace_open(a, inpath) < 0) {
+        perror(inpath);
+        exit(1);
+    }
+    if (ctrace_open(b, outpath) < 0) {
+        perror(outpath);
+        exit(1);
+    }
+    for (;;) {
+        /* Skip what the conversion drops, as main does */
+        while ((more_a = ctrace_next(a, &op_a, &addr_a, &size_a)) &&
+               strchr("ILSM", op_a) == NULL)
+            ;
+        more_b = ctrace_next(b, &op_b, &addr_b, &size_b);
+        if (!more_a || !more_b) {
+            if (more_a || more_b)
+                printf("check: %s ends after record %llu\n", more_a ? outpath : inpath, n);
+            else
+                rc = 0;
+            break;
+        }
+        if (op_a != op_b || addr_a != addr_b || size_a != size_b || a->thread != b->thread) {
+            printf("check: record %llu is %c %llx,%d (thread %d), read back as "
+                   "%c %llx,%d (thread %d)\n", n, op_a, addr_a, size_a, a->thread,
+                   op_b, addr_b, size_b, b->thread);
+            break;
+        }
+        n++;
+    }
+    ctrace_close(a);
+    ctrace_close(b);
+    free(a);
+    free(b);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    ctrace_reader_t in;
+    ctrace_writer_t *out = NULL;
+    FILE *text = NULL;
+    struct stat st;
+    unsigned long long addr, n = 0;
+    int c, size, decode = 0, verify = 0;
+    char op;
+
+    while ((c = getopt(argc, argv, "hdc")) != -1) {
+        switch (c) {
+        case 'd':
+            decode = 1;
+            break;
+        case 'c':
+            verify = 1;
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv);
+        exit(1);
+    }
+
+    if (ctrace_open(&in, argv[optind]) < 0) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    if (decode)
+        text = fopen(argv[optind + 1], "w");
+    else
+        out = ctrace_create(argv[optind + 1]);
+    if (text == NULL && out == NULL) {
+        perror(argv[optind + 1]);
+        exit(1);
+    }
+
+    while (ctrace_next(&in, &op, &addr, &size)) {
+        /* Only the four lackey operations survive the conversion */
+        if (strchr("ILSM", op) == NULL)
+            continue;
+        if (decode) {
+            if (op == 'I')
+                fprintf(text, "I  %08llx,%d", addr, size);
+            else
+                fprintf(text, " %c %08llx,%d", op, addr, size);
+            if (in.thread != 0)
+                fprintf(text, " %d", in.thread);
+            fprintf(text, "\n");
+        } else {
+            ctrace_set_thread(out, in.thread);
+            if (ctrace_write(out, op, addr, size) < 0) {
+                perror(argv[optind + 1]);
+                exit(1);
+            }
+        }
+        n++;
+    }
+
+    if ((decode && fclose(text) != 0) || (!decode && ctrace_finish(out) < 0)) {
+        perror(argv[optind + 1]);
+        exit(1);
+    }
+    if (stat(argv[optind + 1], &st) == 0)
+        printf("%llu records, %lu -> %lld bytes (%.1fx), %.2f bytes/record\n",
+               n, (unsigned long)in.size, (long long)st.st_size,
+               st.st_size ? (double)in.size / st.st_size : 0.0,
+               n ? (double)st.st_size / n : 0.0);
+    ctrace_close(&in);
+    if (verify) {
+        if (check(argv[optind], argv[optind + 1]) < 0)
+            exit(1);
+        printf("check: %llu records read back unchanged\n", n);
+    }
+    return 0;
+}
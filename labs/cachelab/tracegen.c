@@ -4,7 +4,14 @@
  * 
  * The beginning and end of each registered transpose function's trace
  * is indicated by reading from "marker" addresses. These two marker
- * addresses are recorded in file for later use.
+ * addresses, and the address of a local that tells test-trans where the
+ * stack is, are recorded in file (.marker, or -m <file>) for later use.
+ *
+ * With -s, -E and -b, tracegen-sim (tracegen built with -DCACHEHOOK and
+ * linked with trans.c compiled for cachehook.c) simulates each function
+ * on an in-process cache of that geometry instead and prints its hits,
+ * misses and evictions. No valgrind, trace or marker file is involved.
+ * The plain tracegen that runs under valgrind leaves all of that out.
  */
 
 #include <stdlib.h>
@@ -13,6 +20,9 @@
 #include <unistd.h>
 #include <getopt.h>
 #include "cachelab.h"
+#ifdef CACHEHOOK
+#include "cachehook.h"
+#endif
 #include <string.h>
 
 /* External variables declared in cachelab.c */
@@ -22,6 +32,10 @@ extern int func_counter;
 /* External function from trans.c */
 extern void registerFunctions();
 
+/* External functions from trans-tuned.c and trans-simd.c */
+extern void registerTunedFunctions();
+extern void registerSimdFunctions();
+
 /* Markers used to bound trace regions of interest */
 volatile char MARKER_START, MARKER_END;
 
@@ -46,12 +60,46 @@ int validate(int fn,int M, int N, int A[N][M], int B[M][N]) {
     return 1;
 }
 
+#ifdef CACHEHOOK
+/*
+ * simulate - Run function fn with its loads and stores going to a fresh
+ *     cache, print the counts, and return 0 if fn transposed correctly.
+ *     Besides the function's own accesses, the valgrind window between
+ *     the markers holds the marker stores and the loads of the function
+ *     pointer, M and N for the call; those are simulated too, so the
+ *     counts match the valgrind path.
+ */
+int simulate(int fn, int s, int E, int b)
+{
+    cache_t *cache = cache_init(s, E, b, NULL, LRU);
+    if (!cache) {
+        printf("./tracegen: bad cache geometry s=%d E=%d b=%d\n", s, E, b);
+        exit(1);
+    }
+    cache_simulate(cache, 'S', (unsigned long long)&MARKER_START, 1);
+    cache_simulate(cache, 'L', (unsigned long long)&func_list[fn].func_ptr, 8);
+    cache_simulate(cache, 'L', (unsigned long long)&M, 4);
+    cache_simulate(cache, 'L', (unsigned long long)&N, 4);
+    cachehook_attach(cache);
+    (*func_list[fn].func_ptr)(M, N, A, B);
+    cachehook_attach(NULL);
+    cache_simulate(cache, 'S', (unsigned long long)&MARKER_END, 1);
+
+    printf("func %d: hits:%lld misses:%lld evictions:%lld\n",
+           fn, cache->hits, cache->misses, cache->evictions);
+    cache_free(cache);
+    return validate(fn, M, N, A, B);
+}
+#endif
+
 int main(int argc, char* argv[]){
     int i;
 
     char c;
     int selectedFunc=-1;
-    while( (c=getopt(argc,argv,"M:N:F:")) != -1){
+    int s = -1, E = 0, b = -1;
+    char *marker = ".marker";
+    while( (c=getopt(argc,argv,"M:N:F:s:E:b:m:")) != -1){
         switch(c){
         case 'M':
             M = atoi(optarg);
@@ -62,6 +110,18 @@ int main(int argc, char* argv[]){
         case 'F':
             selectedFunc = atoi(optarg);
             break;
+        case 's':
+            s = atoi(optarg);
+            break;
+        case 'E':
+            E = atoi(optarg);
+            break;
+        case 'b':
+            b = atoi(optarg);
+            break;
+        case 'm':
+            marker = optarg;
+            break;
         case '?':
         default:
             printf("./tracegen failed to parse its options.\n");
@@ -72,16 +132,39 @@ int main(int argc, char* argv[]){
 
     /*  Register transpose functions */
     registerFunctions();
+    registerTunedFunctions();
+    registerSimdFunctions();
 
     /* Fill A with data */
     initMatrix(M,N, A, B); 
 
-    /* Record marker addresses */
-    FILE* marker_fp = fopen(".marker","w");
+    /* Simulate in-process instead of leaving it to valgrind */
+    if (s >= 0) {
+#ifdef CACHEHOOK
+        if (!cachehook_instrumented) {
+            printf("./tracegen: trans.c was not built for cachehook.c\n");
+            exit(1);
+        }
+        for (i = 0; i < func_counter; i++) {
+            if ((selectedFunc == -1 || selectedFunc == i) && !simulate(i, s, E, b))
+                return i+1;
+        }
+        return 0;
+#else
+        (void)E;
+        (void)b;
+        printf("./tracegen: built without instrumentation, use ./tracegen-sim\n");
+        exit(1);
+#endif
+    }
+
+    /* Record marker addresses, and where the stack is */
+    FILE* marker_fp = fopen(marker,"w");
     assert(marker_fp);
-    fprintf(marker_fp, "%llx %llx", 
+    fprintf(marker_fp, "%llx %llx %llx", 
             (unsigned long long int) &MARKER_START,
-            (unsigned long long int) &MARKER_END );
+            (unsigned long long int) &MARKER_END,
+            (unsigned long long int) &i );
     fclose(marker_fp);
 
     if (-1==selectedFunc) {
@@ -0,0 +1,192 @@
+/*
+ * trans-simd.c - Matrix transpose B = A^T in SIMD registers
+ *
+ * The functions here transpose a 4x4 (SSE2) or 8x8 (AVX2) block of A at
+ * a time: one vector load per row of the block, a fixed sequence of
+ * unpacks and lane shuffles, and one vector store per row of the block
+ * of B. The blocks are walked TILE x TILE elements at a time so that both
+ * tiles stay in cache, and the rows and columns past the last whole block
+ * are copied one element at a time, so any M x N works.
+ *
+ * When B is too big to stay in cache anyway, it is written with
+ * non-temporal stores, which skip the cache instead of evicting A from
+ * it. Those need B's rows aligned to the vector size.
+ *
+ * Like the tag search kernels of cachesim.c, the AVX2 code is compiled
+ * with a target attribute and only registered if the CPU runs it.
+ */
+#include "cachelab.h"
+#include <stdint.h>
+#include <immintrin.h>
+
+// side of the tiles the blocks are walked in; a multiple of 8
+#define TILE 64
+
+// outputs of at least this many bytes are written around the cache
+#define NT_BYTES (8 << 20)
+
+#define SIMD_INLINE static inline __attribute__((always_inline))
+
+/*
+ * trans_edges - Copy the rows from n0 and the columns from m0 (those
+ *     past the last whole block) one element at a time
+ */
+static void trans_edges(int M, int N, int A[N][M], int B[M][N], int m0, int n0) {
+  int i, j;
+
+  for (i = 0; i < N; i++) {
+    for (j = (i < n0) ? m0 : 0; j < M; j++) {
+      B[j][i] = A[i][j];
+    }
+  }
+}
+
+/*
+ * use_stream - Whether to write B with non-temporal stores of k ints:
+ *     only for large outputs whose rows are all aligned to them
+ */
+static int use_stream(int M, int N, int B[M][N], int k) {
+  return (size_t)M * N * sizeof(int) >= NT_BYTES && N % k == 0 &&
+         (uintptr_t)B % (k * sizeof(int)) == 0;
+}
+
+/*
+ * block_4x4 - B[j..j+3][i..i+3] = A[i..i+3][j..j+3]^T
+ */
+SIMD_INLINE void block_4x4(int M, int N, int A[N][M], int B[M][N], int i, int j, int nt) {
+  __m128i r0 = _mm_loadu_si128((__m128i*)&A[i][j]);
+  __m128i r1 = _mm_loadu_si128((__m128i*)&A[i + 1][j]);
+  __m128i r2 = _mm_loadu_si128((__m128i*)&A[i + 2][j]);
+  __m128i r3 = _mm_loadu_si128((__m128i*)&A[i + 3][j]);
+
+  // interleave pairs of rows: a0 b0 a1 b1, c0 d0 c1 d1, a2 b2 a3 b3, ...
+  __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+  __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+  __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+  __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+  // then pairs of pairs: a0 b0 c0 d0, a1 b1 c1 d1, ...
+  __m128i c0 = _mm_unpacklo_epi64(t0, t1);
+  __m128i c1 = _mm_unpackhi_epi64(t0, t1);
+  __m128i c2 = _mm_unpacklo_epi64(t2, t3);
+  __m128i c3 = _mm_unpackhi_epi64(t2, t3);
+
+  if (nt) {
+    _mm_stream_si128((__m128i*)&B[j][i], c0);
+    _mm_stream_si128((__m128i*)&B[j + 1][i], c1);
+    _mm_stream_si128((__m128i*)&B[j + 2][i], c2);
+    _mm_stream_si128((__m128i*)&B[j + 3][i], c3);
+  } else {
+    _mm_storeu_si128((__m128i*)&B[j][i], c0);
+    _mm_storeu_si128((__m128i*)&B[j + 1][i], c1);
+    _mm_storeu_si128((__m128i*)&B[j + 2][i], c2);
+    _mm_storeu_si128((__m128i*)&B[j + 3][i], c3);
+  }
+}
+
+/*
+ * block_8x8 - B[j..j+7][i..i+7] = A[i..i+7][j..j+7]^T
+ */
+__attribute__((target("avx2"))) SIMD_INLINE void
+block_8x8(int M, int N, int A[N][M], int B[M][N], int i, int j, int nt) {
+  __m256i r0 = _mm256_loadu_si256((__m256i*)&A[i][j]);
+  __m256i r1 = _mm256_loadu_si256((__m256i*)&A[i + 1][j]);
+  __m256i r2 = _mm256_loadu_si256((__m256i*)&A[i + 2][j]);
+  __m256i r3 = _mm256_loadu_si256((__m256i*)&A[i + 3][j]);
+  __m256i r4 = _mm256_loadu_si256((__m256i*)&A[i + 4][j]);
+  __m256i r5 = _mm256_loadu_si256((__m256i*)&A[i + 5][j]);
+  __m256i r6 = _mm256_loadu_si256((__m256i*)&A[i + 6][j]);
+  __m256i r7 = _mm256_loadu_si256((__m256i*)&A[i + 7][j]);
+
+  // the 4x4 sequence within each 128-bit lane: a0 b0 c0 d0 | a4 b4 c4 d4, ...
+  __m256i t0 = _mm256_unpacklo_epi32(r0, r1);
+  __m256i t1 = _mm256_unpackhi_epi32(r0, r1);
+  __m256i t2 = _mm256_unpacklo_epi32(r2, r3);
+  __m256i t3 = _mm256_unpackhi_epi32(r2, r3);
+  __m256i t4 = _mm256_unpacklo_epi32(r4, r5);
+  __m256i t5 = _mm256_unpackhi_epi32(r4, r5);
+  __m256i t6 = _mm256_unpacklo_epi32(r6, r7);
+  __m256i t7 = _mm256_unpackhi_epi32(r6, r7);
+
+  __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+  __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+  __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+  __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+  __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+  __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+  __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+  __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+  // then join the low lanes of rows 0-3 and 4-7 into columns 0-3, the
+  // high lanes into columns 4-7
+  __m256i c0 = _mm256_permute2x128_si256(u0, u4, 0x20);
+  __m256i c1 = _mm256_permute2x128_si256(u1, u5, 0x20);
+  __m256i c2 = _mm256_permute2x128_si256(u2, u6, 0x20);
+  __m256i c3 = _mm256_permute2x128_si256(u3, u7, 0x20);
+  __m256i c4 = _mm256_permute2x128_si256(u0, u4, 0x31);
+  __m256i c5 = _mm256_permute2x128_si256(u1, u5, 0x31);
+  __m256i c6 = _mm256_permute2x128_si256(u2, u6, 0x31);
+  __m256i c7 = _mm256_permute2x128_si256(u3, u7, 0x31);
+
+  if (nt) {
+    _mm256_stream_si256((__m256i*)&B[j][i], c0);
+    _mm256_stream_si256((__m256i*)&B[j + 1][i], c1);
+    _mm256_stream_si256((__m256i*)&B[j + 2][i], c2);
+    _mm256_stream_si256((__m256i*)&B[j + 3][i], c3);
+    _mm256_stream_si256((__m256i*)&B[j + 4][i], c4);
+    _mm256_stream_si256((__m256i*)&B[j + 5][i], c5);
+    _mm256_stream_si256((__m256i*)&B[j + 6][i], c6);
+    _mm256_stream_si256((__m256i*)&B[j + 7][i], c7);
+  } else {
+    _mm256_storeu_si256((__m256i*)&B[j][i], c0);
+    _mm256_storeu_si256((__m256i*)&B[j + 1][i], c1);
+    _mm256_storeu_si256((__m256i*)&B[j + 2][i], c2);
+    _mm256_storeu_si256((__m256i*)&B[j + 3][i], c3);
+    _mm256_storeu_si256((__m256i*)&B[j + 4][i], c4);
+    _mm256_storeu_si256((__m256i*)&B[j + 5][i], c5);
+    _mm256_storeu_si256((__m256i*)&B[j + 6][i], c6);
+    _mm256_storeu_si256((__m256i*)&B[j + 7][i], c7);
+  }
+}
+
+/*
+ * The tile walk. Within a tile the blocks go along rows of B, so each
+ * row of B is written in consecutive vectors, which fills whole lines
+ * for the non-temporal stores to write out.
+ */
+#define DEFINE_TRANS_SIMD(name, k, block, attr)                                             \
+  attr void name(int M, int N, int A[N][M], int B[M][N]) {                                  \
+    int m0 = M - M % k, n0 = N - N % k;                                                     \
+    int nt = use_stream(M, N, B, k);                                                        \
+    int ii, jj, i, j;                                                                       \
+                                                                                            \
+    for (jj = 0; jj < m0; jj += TILE) {                                                     \
+      for (ii = 0; ii < n0; ii += TILE) {                                                   \
+        for (j = jj; j < jj + TILE && j < m0; j += k) {                                     \
+          for (i = ii; i < ii + TILE && i < n0; i += k) {                                   \
+            block(M, N, A, B, i, j, nt);                                                    \
+          }                                                                                 \
+        }                                                                                   \
+      }                                                                                     \
+    }                                                                                       \
+    if (nt) {                                                                               \
+      _mm_sfence();                                                                         \
+    }                                                                                       \
+    trans_edges(M, N, A, B, m0, n0);                                                        \
+  }
+
+char transpose_sse_4x4_desc[] = "SSE 4x4 in-register transpose";
+DEFINE_TRANS_SIMD(transpose_sse_4x4, 4, block_4x4, )
+
+char transpose_avx2_8x8_desc[] = "AVX2 8x8 in-register transpose";
+DEFINE_TRANS_SIMD(transpose_avx2_8x8, 8, block_8x8, __attribute__((target("avx2"))))
+
+/*
+ * registerSimdFunctions - Register the SIMD transposes the CPU can run
+ */
+void registerSimdFunctions() {
+  registerTransFunction(transpose_sse_4x4, transpose_sse_4x4_desc);
+  if (__builtin_cpu_supports("avx2")) {
+    registerTransFunction(transpose_avx2_8x8, transpose_avx2_8x8_desc);
+  }
+}
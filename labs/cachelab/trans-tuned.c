@@ -0,0 +1,52 @@
+/*
+ * trans-tuned.c - Transpose kernels tuned for a cache of s=5, E=1, b=5
+ *
+ * Generated by ./transtune; do not edit.
+ * Each kernel is transkern.h's transpose_kernel with the arguments
+ * that missed least on its shape, as constants.
+ */
+#include "cachelab.h"
+#include "transkern.h"
+
+/* 32x32: 8x8 blocks by rows, through registers, 284 misses */
+static void transpose_tuned_32x32(int M, int N, int A[N][M], int B[M][N])
+{
+    transpose_kernel(M, N, A, B, 8, 8, TK_ROWS, 0, 1);
+}
+
+/* 64x64: 4x8 blocks by columns, through registers, 1648 misses */
+static void transpose_tuned_64x64(int M, int N, int A[N][M], int B[M][N])
+{
+    transpose_kernel(M, N, A, B, 4, 8, TK_COLS, 0, 1);
+}
+
+/* 61x67: 17x4 blocks by rows, through registers, 1708 misses */
+static void transpose_tuned_61x67(int M, int N, int A[N][M], int B[M][N])
+{
+    transpose_kernel(M, N, A, B, 17, 4, TK_ROWS, 0, 1);
+}
+
+/*
+ * transpose_tuned - The tuned kernel of the shape, or plain 8x8 blocking
+ *     for shapes that were not tuned
+ */
+char transpose_tuned_desc[] = "Autotuned blocked transpose";
+void transpose_tuned(int M, int N, int A[N][M], int B[M][N])
+{
+    if (M == 32 && N == 32)
+        transpose_tuned_32x32(M, N, A, B);
+    else if (M == 64 && N == 64)
+        transpose_tuned_64x64(M, N, A, B);
+    else if (M == 61 && N == 67)
+        transpose_tuned_61x67(M, N, A, B);
+    else
+        transpose_kernel(M, N, A, B, 8, 8, TK_ROWS, 0, 0);
+}
+
+/*
+ * registerTunedFunctions - Register the tuned transpose with the driver
+ */
+void registerTunedFunctions()
+{
+    registerTransFunction(transpose_tuned, transpose_tuned_desc);
+}
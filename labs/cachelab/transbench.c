@@ -0,0 +1,322 @@
+/*
+ * transbench.c - Times the registered transpose functions on real hardware
+ *
+ * test-trans scores the functions of trans.c by their misses on a
+ * simulated 1KB cache. transbench runs them, built at -O2, on matrices up
+ * to MAXDIM x MAXDIM and reports the bandwidth they reach (bytes read
+ * plus bytes written per second), so the simulated wins can be checked
+ * against the hardware.
+ *
+ * Each function is run -w times to warm up, then timed with the K-best
+ * scheme: runs are repeated until the K fastest are within epsilon of
+ * each other, or -n runs have been made, and the fastest is reported.
+ * One more run is counted with the hardware counters of perf_event_open
+ * (last level cache references and misses, L1 data read misses and data
+ * TLB read misses); they show as "-" where the kernel does not allow it.
+ *
+ *   linux> ./transbench 1024x1024 8192x8192
+ */
+/* for syscall and clock_gettime under -std=c99 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "cachelab.h"
+
+/* Largest matrix dimension */
+#define MAXDIM 8192
+
+/* Most shapes benchmarked in one run */
+#define MAXSHAPES 16
+
+/* Functions may run up to a block past the edge of a matrix that is
+   not a multiple of it (as into tracegen's static arrays), so each
+   matrix is allocated with this many extra rows and columns */
+#define SLACK 8
+
+/* External variables declared in cachelab.c */
+extern trans_func_t func_list[MAX_TRANS_FUNCS];
+extern int func_counter;
+
+/* External function from trans.c */
+extern void registerFunctions();
+
+/* External functions from trans-tuned.c and trans-simd.c */
+extern void registerTunedFunctions();
+extern void registerSimdFunctions();
+
+/* Globals set on the command line */
+static int warmups = 1;        /* -w */
+static int kbest = 3;          /* -k */
+static double epsilon = 0.01;  /* -e */
+static int maxruns = 20;       /* -n */
+static int only = -1;          /* -f: the one function to run, -1 for all */
+
+/* The hardware counters, and their column headings */
+#define NUM_COUNTERS 4
+static const char *counter_names[NUM_COUNTERS] = {
+    "LLC-refs", "LLC-misses", "L1d-misses", "dTLB-misses"};
+static const struct { unsigned type; unsigned long long config; } counter_events[NUM_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+static int counter_fds[NUM_COUNTERS];
+
+/* The signature of a transpose function */
+typedef void (*trans_fn_t)(int M, int N, int[N][M], int[M][N]);
+
+/*
+ * open_counters - Open the counters of this thread, disabled; those the
+ *     kernel refuses get fd -1
+ */
+void open_counters()
+{
+    struct perf_event_attr attr;
+    int c;
+
+    for (c = 0; c < NUM_COUNTERS; c++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[c].type;
+        attr.config = counter_events[c].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counter_fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+/*
+ * now - Seconds on the monotonic clock
+ */
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * time_run - Seconds taken by one call of f
+ */
+double time_run(trans_fn_t f, int M, int N, int *A, int *B)
+{
+    double start = now();
+    f(M, N, (int (*)[M])A, (int (*)[N])B);
+    return now() - start;
+}
+
+/*
+ * time_kbest - The fastest of the runs of f, made until the kbest fastest
+ *     are within epsilon of each other or maxruns have been made. *runs
+ *     is set to the number made.
+ */
+double time_kbest(trans_fn_t f, int M, int N, int *A, int *B, int *runs)
+{
+    double best[maxruns], t;
+    int n, i;
+
+    best[0] = time_run(f, M, N, A, B);
+    for (n = 1; n < maxruns; n++) {
+        if (n >= kbest && best[kbest - 1] <= best[0] * (1 + epsilon))
+            break;
+        /* Insert the time into the sorted best[0..n] */
+        t = time_run(f, M, N, A, B);
+        for (i = n; i > 0 && best[i - 1] > t; i--)
+            best[i] = best[i - 1];
+        best[i] = t;
+    }
+    *runs = n;
+    return best[0];
+}
+
+/*
+ * count_run - Count the hardware events of one call of f; a counter
+ *     that is not available reads -1
+ */
+void count_run(trans_fn_t f, int M, int N, int *A, int *B, long long counts[])
+{
+    int c;
+
+    for (c = 0; c < NUM_COUNTERS; c++) {
+        if (counter_fds[c] >= 0) {
+            ioctl(counter_fds[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter_fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    f(M, N, (int (*)[M])A, (int (*)[N])B);
+    for (c = 0; c < NUM_COUNTERS; c++) {
+        counts[c] = -1;
+        if (counter_fds[c] >= 0) {
+            ioctl(counter_fds[c], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counter_fds[c], &counts[c], sizeof(counts[c])) != sizeof(counts[c]))
+                counts[c] = -1;
+        }
+    }
+}
+
+/*
+ * is_transposed - Whether B holds A^T
+ */
+int is_transposed(int M, int N, int A[N][M], int B[M][N])
+{
+    int i, j;
+    for (i = 0; i < N; i++)
+        for (j = 0; j < M; j++)
+            if (A[i][j] != B[j][i])
+                return 0;
+    return 1;
+}
+
+/*
+ * bench_shape - Benchmark the functions on an MxN matrix
+ */
+void bench_shape(int M, int N)
+{
+    size_t elems = (size_t)(M + SLACK) * (N + SLACK);
+    double bytes = 2.0 * M * N * sizeof(int);
+    long long counts[NUM_COUNTERS];
+    int *A, *B, f, c, runs;
+    double t;
+
+    if (posix_memalign((void **)&A, 64, elems * sizeof(int)) != 0 ||
+        posix_memalign((void **)&B, 64, elems * sizeof(int)) != 0) {
+        printf("Error: out of memory for %dx%d\n", M, N);
+        exit(1);
+    }
+    initMatrix(M, N, (int (*)[M])A, (int (*)[N])B);
+
+    printf("\n%dx%d (%.1f MB per matrix)\n", M, N, M * (double)N * sizeof(int) / (1 << 20));
+    printf("%-5s %9s %11s %5s", "func", "GB/s", "ms", "runs");
+    for (c = 0; c < NUM_COUNTERS; c++)
+        printf(" %12s", counter_names[c]);
+    printf("  description\n");
+
+    for (f = 0; f < func_counter; f++) {
+        if (only >= 0 && f != only)
+            continue;
+        trans_fn_t fn = func_list[f].func_ptr;
+
+        /* The first warmup run doubles as the correctness check */
+        memset(B, 0, elems * sizeof(int));
+        time_run(fn, M, N, A, B);
+        if (!is_transposed(M, N, (int (*)[M])A, (int (*)[N])B)) {
+            printf("%-5d %9s %11s %5s", f, "-", "-", "-");
+            for (c = 0; c < NUM_COUNTERS; c++)
+                printf(" %12s", "-");
+            printf("  %s (incorrect)\n", func_list[f].description);
+            continue;
+        }
+        for (c = 1; c < warmups; c++)
+            time_run(fn, M, N, A, B);
+
+        t = time_kbest(fn, M, N, A, B, &runs);
+        count_run(fn, M, N, A, B, counts);
+
+        printf("%-5d %9.2f %11.3f %5d", f, bytes / t / 1e9, t * 1e3, runs);
+        for (c = 0; c < NUM_COUNTERS; c++) {
+            if (counts[c] < 0)
+                printf(" %12s", "-");
+            else
+                printf(" %12lld", counts[c]);
+        }
+        printf("  %s\n", func_list[f].description);
+        fflush(stdout);
+    }
+    free(A);
+    free(B);
+}
+
+/*
+ * usage - Print usage info
+ */
+void usage(char *argv[])
+{
+    printf("Usage: %s [-h] [-f <id>] [-w <n>] [-k <K>] [-e <eps>] [-n <n>] [MxN...]\n",
+           argv[0]);
+    printf("Options:\n");
+    printf("  -h          Print this help message.\n");
+    printf("  -f <id>     Only run function <id>.\n");
+    printf("  -w <n>      Warmup runs (default 1).\n");
+    printf("  -k <K>      Runs that must agree (default 3).\n");
+    printf("  -e <eps>    How closely, as a fraction (default 0.01).\n");
+    printf("  -n <n>      Most timed runs (default 20).\n");
+    printf("  MxN         Shapes to run, M columns by N rows as for test-trans,\n");
+    printf("              up to %dx%d (default 256x256 1024x1024 4096x4096).\n",
+           MAXDIM, MAXDIM);
+}
+
+int main(int argc, char *argv[])
+{
+    int shapes[MAXSHAPES][2], nshapes = 0, c, i;
+
+    while ((c = getopt(argc, argv, "hf:w:k:e:n:")) != -1) {
+        switch (c) {
+        case 'f':
+            only = atoi(optarg);
+            break;
+        case 'w':
+            warmups = atoi(optarg);
+            break;
+        case 'k':
+            kbest = atoi(optarg);
+            break;
+        case 'e':
+            epsilon = atof(optarg);
+            break;
+        case 'n':
+            maxruns = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+    if (warmups < 1 || kbest < 1 || maxruns < kbest || epsilon < 0) {
+        printf("Error: need -w >= 1, 1 <= -k <= -n and -e >= 0\n");
+        exit(1);
+    }
+    for (i = optind; i < argc; i++) {
+        if (nshapes == MAXSHAPES ||
+            sscanf(argv[i], "%dx%d", &shapes[nshapes][0], &shapes[nshapes][1]) != 2 ||
+            shapes[nshapes][0] < 1 || shapes[nshapes][0] > MAXDIM ||
+            shapes[nshapes][1] < 1 || shapes[nshapes][1] > MAXDIM) {
+            printf("Error: bad shape '%s' (at most %d shapes up to %dx%d)\n", argv[i],
+                   MAXSHAPES, MAXDIM, MAXDIM);
+            exit(1);
+        }
+        nshapes++;
+    }
+    if (nshapes == 0) {
+        for (; nshapes < 3; nshapes++)
+            shapes[nshapes][0] = shapes[nshapes][1] = 256 << (2 * nshapes);
+    }
+
+    registerFunctions();
+    registerTunedFunctions();
+    registerSimdFunctions();
+    if (only >= func_counter) {
+        printf("Error: there is no function %d\n", only);
+        exit(1);
+    }
+    open_counters();
+    printf("Best of %d runs within %g%%, after %d warmup run%s\n", kbest, epsilon * 100,
+           warmups, warmups == 1 ? "" : "s");
+    for (i = 0; i < nshapes; i++)
+        bench_shape(shapes[i][0], shapes[i][1]);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * transkern.h - A parameterized blocked transpose kernel
+ *
+ * transpose_kernel covers a family of blocked transposes B = A^T, chosen
+ * by its last five arguments:
+ *
+ *   bi, bj  the blocks are bi rows by bj columns of A
+ *   order   TK_ROWS walks the blocks, and each block, a row of A at a
+ *           time (writing a column of B); TK_COLS a column of A at a time
+ *           (writing a row of B)
+ *   diag    on a diagonal block, copy the element on the diagonal last,
+ *           so that A's line and B's line (which share a set when A and B
+ *           are aligned alike) are not evicted in turn mid-line
+ *   regs    read the whole line of the block into registers before
+ *           writing any of it (the line must be at most TK_MAXREGS long)
+ *
+ * It is always inlined, so when optimizing (as trans-tuned-bench.o for
+ * transbench is built) a caller that passes constants, as the kernels
+ * transtune writes to trans-tuned.c do, gets a kernel specialized at
+ * compile time. The -O0 builds that test-trans and tracegen run inline
+ * it too but keep the parameters as variables; their loads and stores of
+ * A and B are the same either way.
+ *
+ * Matrix accesses go through TK_LOAD and TK_STORE, which transtune
+ * redefines to simulate them before including this file.
+ */
+#ifndef TRANSKERN_H
+#define TRANSKERN_H
+
+#define TK_ROWS 0
+#define TK_COLS 1
+#define TK_MAXREGS 8
+
+#ifndef TK_LOAD
+#define TK_LOAD(X, r, c) ((X)[r][c])
+#define TK_STORE(X, r, c, v) ((X)[r][c] = (v))
+#endif
+
+/*
+ * tk_line - Copy one line of n elements of a block: A[i][j] to B[j][i]
+ *     for i = i0 + k*di, j = j0 + k*dj, k = 0..n-1
+ */
+static inline __attribute__((always_inline)) void
+tk_line(int M, int N, int A[N][M], int B[M][N], int i0, int j0, int di, int dj,
+        int n, int diag, int regs)
+{
+    int k, t0 = 0, t1 = 0, t2 = 0, t3 = 0, t4 = 0, t5 = 0, t6 = 0, t7 = 0;
+
+    /* The k at which the line crosses the diagonal, or -1 */
+    int kd = -1;
+    if (diag) {
+        k = di ? j0 - i0 : i0 - j0;
+        if (k >= 0 && k < n)
+            kd = k;
+    }
+
+    if (regs) {
+        /* Every load before any store, in order */
+        t0 = TK_LOAD(A, i0, j0);
+        if (n > 1) t1 = TK_LOAD(A, i0 + di, j0 + dj);
+        if (n > 2) t2 = TK_LOAD(A, i0 + 2*di, j0 + 2*dj);
+        if (n > 3) t3 = TK_LOAD(A, i0 + 3*di, j0 + 3*dj);
+        if (n > 4) t4 = TK_LOAD(A, i0 + 4*di, j0 + 4*dj);
+        if (n > 5) t5 = TK_LOAD(A, i0 + 5*di, j0 + 5*dj);
+        if (n > 6) t6 = TK_LOAD(A, i0 + 6*di, j0 + 6*dj);
+        if (n > 7) t7 = TK_LOAD(A, i0 + 7*di, j0 + 7*dj);
+        if (kd != 0) TK_STORE(B, j0, i0, t0);
+        if (n > 1 && kd != 1) TK_STORE(B, j0 + dj, i0 + di, t1);
+        if (n > 2 && kd != 2) TK_STORE(B, j0 + 2*dj, i0 + 2*di, t2);
+        if (n > 3 && kd != 3) TK_STORE(B, j0 + 3*dj, i0 + 3*di, t3);
+        if (n > 4 && kd != 4) TK_STORE(B, j0 + 4*dj, i0 + 4*di, t4);
+        if (n > 5 && kd != 5) TK_STORE(B, j0 + 5*dj, i0 + 5*di, t5);
+        if (n > 6 && kd != 6) TK_STORE(B, j0 + 6*dj, i0 + 6*di, t6);
+        if (n > 7 && kd != 7) TK_STORE(B, j0 + 7*dj, i0 + 7*di, t7);
+        switch (kd) {
+        case 0: TK_STORE(B, j0, i0, t0); break;
+        case 1: TK_STORE(B, j0 + dj, i0 + di, t1); break;
+        case 2: TK_STORE(B, j0 + 2*dj, i0 + 2*di, t2); break;
+        case 3: TK_STORE(B, j0 + 3*dj, i0 + 3*di, t3); break;
+        case 4: TK_STORE(B, j0 + 4*dj, i0 + 4*di, t4); break;
+        case 5: TK_STORE(B, j0 + 5*dj, i0 + 5*di, t5); break;
+        case 6: TK_STORE(B, j0 + 6*dj, i0 + 6*di, t6); break;
+        case 7: TK_STORE(B, j0 + 7*dj, i0 + 7*di, t7); break;
+        }
+        return;
+    }
+
+    /* One element at a time, holding back the diagonal one */
+    for (k = 0; k < n; k++) {
+        if (k == kd)
+            t0 = TK_LOAD(A, i0 + k*di, j0 + k*dj);
+        else
+            TK_STORE(B, j0 + k*dj, i0 + k*di, TK_LOAD(A, i0 + k*di, j0 + k*dj));
+    }
+    if (kd >= 0)
+        TK_STORE(B, j0 + kd*dj, i0 + kd*di, t0);
+}
+
+/*
+ * transpose_kernel - B = A^T in bi x bj blocks of A (see above)
+ */
+static inline __attribute__((always_inline)) void
+transpose_kernel(int M, int N, int A[N][M], int B[M][N], int bi, int bj,
+                 int order, int diag, int regs)
+{
+    int i, j, ii, jj, ni, nj;
+
+    if (order == TK_ROWS) {
+        for (ii = 0; ii < N; ii += bi) {
+            ni = (ii + bi < N) ? bi : N - ii;
+            for (jj = 0; jj < M; jj += bj) {
+                nj = (jj + bj < M) ? bj : M - jj;
+                for (i = ii; i < ii + ni; i++)
+                    tk_line(M, N, A, B, i, jj, 0, 1, nj, diag, regs);
+            }
+        }
+    } else {
+        for (jj = 0; jj < M; jj += bj) {
+            nj = (jj + bj < M) ? bj : M - jj;
+            for (ii = 0; ii < N; ii += bi) {
+                ni = (ii + bi < N) ? bi : N - ii;
+                for (j = jj; j < jj + nj; j++)
+                    tk_line(M, N, A, B, ii, j, 1, 0, ni, diag, regs);
+            }
+        }
+    }
+}
+
+#endif /* TRANSKERN_H */
@@ -0,0 +1,317 @@
+/*
+ * transtune.c - Autotune the blocked transpose kernels of transkern.h
+ *
+ * For each shape MxN, every kernel of the family in transkern.h (block
+ * sizes up to MAXBLOCK, both walk orders, with and without diagonal
+ * handling and the register copy) is run on a cachesim cache of
+ * -s/-E/-b. The kernel with the fewest misses for each shape is written
+ * to trans-tuned.c (or -o <file>) as a call of transpose_kernel with
+ * constant arguments, which optimizing builds specialize, and
+ * transpose_tuned dispatches to it on the shape. test-trans, tracegen,
+ * transtune and transbench register it after the functions of trans.c,
+ * followed by those of trans-simd.c.
+ *
+ * The registered functions of trans.c are simulated the same way,
+ * through the cachehook instrumentation of trans-sim.o, and the best of
+ * them is reported next to the tuned kernel. Both run on static A and B
+ * declared as in tracegen, and count the accesses of the transpose only;
+ * test-trans also counts the few accesses around the call.
+ *
+ *   linux> ./transtune 32x32 64x64 61x67
+ *   linux> make && ./test-trans -i -M 64 -N 64
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "cachelab.h"
+#include "cachehook.h"
+#include "cachesim.h"
+
+/* Simulate the kernel's matrix accesses, then make them */
+static cache_t *tune_cache;
+
+static inline int tune_load(int *p)
+{
+    cache_simulate(tune_cache, 'L', (unsigned long long)p, sizeof(int));
+    return *p;
+}
+
+static inline void tune_store(int *p, int v)
+{
+    cache_simulate(tune_cache, 'S', (unsigned long long)p, sizeof(int));
+    *p = v;
+}
+
+#define TK_LOAD(X, r, c) tune_load(&(X)[r][c])
+#define TK_STORE(X, r, c, v) tune_store(&(X)[r][c], (v))
+#include "transkern.h"
+
+/* Largest block side tried */
+#define MAXBLOCK 24
+
+/* Largest matrix, as in tracegen */
+#define MAXN 256
+
+/* Most shapes tuned in one run */
+#define MAXSHAPES 16
+
+/* External variables declared in cachelab.c */
+extern trans_func_t func_list[MAX_TRANS_FUNCS];
+extern int func_counter;
+
+/* External function from trans.c */
+extern void registerFunctions();
+
+/* External functions from trans-tuned.c and trans-simd.c */
+extern void registerTunedFunctions();
+extern void registerSimdFunctions();
+
+/* One kernel of the family, and how it did */
+struct kernel {
+    int bi, bj, order, diag, regs;
+    long long misses;
+};
+
+static int A[MAXN][MAXN];
+static int B[MAXN][MAXN];
+
+static const char *order_names[] = {"rows", "columns"};
+
+/*
+ * is_transposed - Whether B holds A^T
+ */
+int is_transposed(int M, int N, int A[N][M], int B[M][N])
+{
+    int i, j;
+    for (i = 0; i < N; i++)
+        for (j = 0; j < M; j++)
+            if (A[i][j] != B[j][i])
+                return 0;
+    return 1;
+}
+
+/*
+ * eval_kernel - Count the misses of kernel k on an MxN matrix, or -1 if
+ *     it does not transpose correctly
+ */
+long long eval_kernel(int M, int N, struct kernel *k)
+{
+    cache_reset(tune_cache);
+    memset(B, 0, sizeof(B));
+    transpose_kernel(M, N, A, B, k->bi, k->bj, k->order, k->diag, k->regs);
+    if (!is_transposed(M, N, A, B))
+        return -1;
+    return tune_cache->misses;
+}
+
+/*
+ * eval_registered - Count the misses of registered function f on an MxN
+ *     matrix, or -1 if it does not transpose correctly
+ */
+long long eval_registered(int M, int N, int f)
+{
+    cache_reset(tune_cache);
+    memset(B, 0, sizeof(B));
+    cachehook_attach(tune_cache);
+    (*func_list[f].func_ptr)(M, N, A, B);
+    cachehook_attach(NULL);
+    if (!is_transposed(M, N, A, B))
+        return -1;
+    return tune_cache->misses;
+}
+
+/*
+ * tune - Find the kernel with the fewest misses on an MxN matrix. Of
+ *     kernels that tie, the first tried (smallest blocks, rows before
+ *     columns, plain before diagonal and register variants) wins.
+ */
+struct kernel tune(int M, int N, int *tried)
+{
+    struct kernel k, best = {0, 0, 0, 0, 0, -1};
+    int line;
+
+    *tried = 0;
+    for (k.bi = 1; k.bi <= MAXBLOCK && k.bi <= N; k.bi++) {
+        for (k.bj = 1; k.bj <= MAXBLOCK && k.bj <= M; k.bj++) {
+            for (k.order = TK_ROWS; k.order <= TK_COLS; k.order++) {
+                line = (k.order == TK_ROWS) ? k.bj : k.bi;
+                for (k.diag = 0; k.diag <= 1; k.diag++) {
+                    for (k.regs = 0; k.regs <= (line <= TK_MAXREGS); k.regs++) {
+                        k.misses = eval_kernel(M, N, &k);
+                        (*tried)++;
+                        if (k.misses >= 0 && (best.misses < 0 || k.misses < best.misses))
+                            best = k;
+                    }
+                }
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * describe - A one line description of kernel k
+ */
+void describe(struct kernel *k, char *buf)
+{
+    sprintf(buf, "%dx%d blocks by %s%s%s", k->bi, k->bj, order_names[k->order],
+            k->diag ? ", diagonal last" : "", k->regs ? ", through registers" : "");
+}
+
+/*
+ * write_kernels - Write the tuned kernels and their dispatcher to path
+ */
+int write_kernels(const char *path, int argc, char *argv[], int nshapes,
+                  int shapes[][2], struct kernel *best, int s, int E, int b)
+{
+    char desc[128];
+    int i;
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+
+    fprintf(fp, "/*\n * %s - Transpose kernels tuned for a cache of s=%d, E=%d, b=%d\n",
+            path, s, E, b);
+    fprintf(fp, " *\n * Generated by");
+    for (i = 0; i < argc; i++)
+        fprintf(fp, " %s", argv[i]);
+    fprintf(fp, "; do not edit.\n * Each kernel is transkern.h's transpose_kernel with the arguments\n"
+            " * that missed least on its shape, as constants.\n */\n");
+    fprintf(fp, "#include \"cachelab.h\"\n#include \"transkern.h\"\n");
+
+    for (i = 0; i < nshapes; i++) {
+        describe(&best[i], desc);
+        fprintf(fp, "\n/* %dx%d: %s, %lld misses */\n", shapes[i][0], shapes[i][1], desc,
+                best[i].misses);
+        fprintf(fp, "static void transpose_tuned_%dx%d(int M, int N, int A[N][M], int B[M][N])\n{\n",
+                shapes[i][0], shapes[i][1]);
+        fprintf(fp, "    transpose_kernel(M, N, A, B, %d, %d, %s, %d, %d);\n}\n",
+                best[i].bi, best[i].bj, best[i].order == TK_ROWS ? "TK_ROWS" : "TK_COLS",
+                best[i].diag, best[i].regs);
+    }
+
+    fprintf(fp, "\n/*\n * transpose_tuned - The tuned kernel of the shape, or plain 8x8 blocking\n"
+            " *     for shapes that were not tuned\n */\n");
+    fprintf(fp, "char transpose_tuned_desc[] = \"Autotuned blocked transpose\";\n");
+    fprintf(fp, "void transpose_tuned(int M, int N, int A[N][M], int B[M][N])\n{\n");
+    for (i = 0; i < nshapes; i++) {
+        fprintf(fp, "    %sif (M == %d && N == %d)\n        transpose_tuned_%dx%d(M, N, A, B);\n",
+                i ? "else " : "", shapes[i][0], shapes[i][1], shapes[i][0], shapes[i][1]);
+    }
+    fprintf(fp, "    %s\n        transpose_kernel(M, N, A, B, 8, 8, TK_ROWS, 0, 0);\n}\n",
+            nshapes ? "else" : "");
+    fprintf(fp, "\n/*\n * registerTunedFunctions - Register the tuned transpose with the driver\n"
+            " */\nvoid registerTunedFunctions()\n{\n"
+            "    registerTransFunction(transpose_tuned, transpose_tuned_desc);\n}\n");
+    return fclose(fp);
+}
+
+/*
+ * usage - Print usage info
+ */
+void usage(char *argv[])
+{
+    printf("Usage: %s [-h] [-s <s>] [-E <E>] [-b <b>] [-o <file>] [MxN...]\n", argv[0]);
+    printf("Options:\n");
+    printf("  -h          Print this help message.\n");
+    printf("  -s <s>      Set index bits of the cache (default 5).\n");
+    printf("  -E <E>      Lines per set (default 1).\n");
+    printf("  -b <b>      Block bits (default 5).\n");
+    printf("  -o <file>   Where to write the kernels (default trans-tuned.c).\n");
+    printf("  MxN         Shapes to tune, M columns by N rows as for test-trans\n");
+    printf("              (default 32x32 64x64 61x67).\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int s = 5, E = 1, b = 5, c, i, f, tried;
+    int shapes[MAXSHAPES][2], nshapes = 0;
+    struct kernel best[MAXSHAPES];
+    char *out = "trans-tuned.c", desc[128];
+
+    while ((c = getopt(argc, argv, "hs:E:b:o:")) != -1) {
+        switch (c) {
+        case 's':
+            s = atoi(optarg);
+            break;
+        case 'E':
+            E = atoi(optarg);
+            break;
+        case 'b':
+            b = atoi(optarg);
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 'h':
+            usage(argv);
+            exit(0);
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        if (nshapes == MAXSHAPES ||
+            sscanf(argv[i], "%dx%d", &shapes[nshapes][0], &shapes[nshapes][1]) != 2 ||
+            shapes[nshapes][0] < 1 || shapes[nshapes][0] > MAXN ||
+            shapes[nshapes][1] < 1 || shapes[nshapes][1] > MAXN) {
+            printf("Error: bad shape '%s' (at most %d shapes up to %dx%d)\n", argv[i],
+                   MAXSHAPES, MAXN, MAXN);
+            exit(1);
+        }
+        nshapes++;
+    }
+    if (nshapes == 0) {
+        static const int defaults[3][2] = {{32, 32}, {64, 64}, {61, 67}};
+        for (; nshapes < 3; nshapes++) {
+            shapes[nshapes][0] = defaults[nshapes][0];
+            shapes[nshapes][1] = defaults[nshapes][1];
+        }
+    }
+    if ((tune_cache = cache_init(s, E, b, NULL, LRU)) == NULL) {
+        printf("Error: bad cache geometry s=%d E=%d b=%d\n", s, E, b);
+        exit(1);
+    }
+    if (!cachehook_instrumented) {
+        printf("Error: trans.c was not built for cachehook.c\n");
+        exit(1);
+    }
+    registerFunctions();
+    registerTunedFunctions();
+    registerSimdFunctions();
+
+    for (i = 0; i < nshapes; i++) {
+        int M = shapes[i][0], N = shapes[i][1];
+        initMatrix(M, N, A, B);
+
+        best[i] = tune(M, N, &tried);
+        describe(&best[i], desc);
+        printf("%dx%d: tuned %s: %lld misses (%d kernels tried)\n", M, N, desc,
+               best[i].misses, tried);
+
+        int best_f = -1;
+        long long best_misses = -1, misses;
+        for (f = 0; f < func_counter; f++) {
+            misses = eval_registered(M, N, f);
+            if (misses >= 0 && (best_f < 0 || misses < best_misses)) {
+                best_f = f;
+                best_misses = misses;
+            }
+        }
+        if (best_f < 0)
+            printf("%dx%d: current best: no registered function is correct\n", M, N);
+        else
+            printf("%dx%d: current best func %d (%s): %lld misses\n", M, N, best_f,
+                   func_list[best_f].description, best_misses);
+    }
+
+    if (write_kernels(out, argc, argv, nshapes, shapes, best, s, E, b) != 0) {
+        perror(out);
+        exit(1);
+    }
+    printf("Kernels written to %s\n", out);
+    cache_free(tune_cache);
+    return 0;
+}
@@ -0,0 +1,521 @@
+/*
+ * mdab.c - A/B comparison driver for malloc packages
+ *
+ * mdriver links exactly one mm.c. mdab instead loads several malloc
+ * packages, each built as a shared library (make mm.so mm-foo.so), into
+ * one process and races them against each other on the same traces:
+ *
+ *   unix> mdab -f short1-bal.rep ./mm.so ./mm-foo.so
+ *
+ * For every trace, each package is timed in a number of rounds. Within
+ * a round every package runs once, in a freshly shuffled order, so that
+ * drift in the machine state (frequency scaling, other load) hits all
+ * packages alike. The first package is the baseline; for each other
+ * package we report its speedup over the baseline with a 95% confidence
+ * interval, and the p-value of Welch's two-sample t-test on the times.
+ *
+ * All packages share the simulated heap in memlib.c, which is why mdab
+ * is linked with -rdynamic: the libraries resolve mem_sbrk and friends
+ * against the driver. mdab only checks that requests succeed; use
+ * mdriver to check a package for correctness.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <dlfcn.h>
+
+#include "memlib.h"
+#include "config.h"
+#include "trace.h"
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define MAXLINE     1024  /* max string size */
+#define MAXPKGS       16  /* max number of packages to compare */
+#define MAXTRACES     64  /* max number of traces given with -f */
+#define ROUNDS        30  /* default number of timed rounds */
+#define MIN_SAMPLE  1e-3  /* a timed sample runs for at least this long */
+#define ALPHA       0.05  /* significance level */
+
+/******************************
+ * The key compound data types
+ *****************************/
+
+/* The entry points of one malloc package loaded from a shared library */
+typedef struct {
+    char *path;
+    void *handle;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    /* optional: NULL if the package lacks the sized/batch interface */
+    void (*free_sized)(void *ptr, size_t size);
+    size_t (*malloc_batch)(size_t n, size_t size, void **out);
+    void (*free_batch)(void **ptrs, size_t n);
+    double *secs;       /* one timed sample per round */
+} package_t;
+
+/* Summary statistics of a set of samples */
+typedef struct {
+    double mean;
+    double var;         /* unbiased sample variance */
+    int n;
+} sample_t;
+
+/********************
+ * Global variables
+ *******************/
+int verbose = 0;                        /* -v: print every sample */
+static package_t pkgs[MAXPKGS];
+static int npkgs = 0;
+
+/* Directory and filenames of the default tracefiles */
+static char tracedir[MAXLINE] = TRACEDIR;
+static char *default_tracefiles[] = {
+    DEFAULT_TRACEFILES, NULL
+};
+
+/*********************
+ * Function prototypes
+ *********************/
+static void load_package(package_t *p, char *path);
+static void *load_symbol(package_t *p, char *name, int required);
+static int replay(package_t *p, trace_t *trace);
+static double time_replay(package_t *p, trace_t *trace, int reps);
+static void compare(char *name, trace_t *trace, int rounds);
+static sample_t summarize(double *x, int n);
+static double welch_p(sample_t a, sample_t b, double *df);
+static double t_quantile(double p, double df);
+static double betai(double a, double b, double x);
+static double betacf(double a, double b, double x);
+static double now(void);
+static void usage(void);
+static void app_error(char *msg);
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv)
+{
+    char *tracefiles[MAXTRACES + 1];
+    char **traces = default_tracefiles;
+    int num_tracefiles = 0;
+    int rounds = ROUNDS;
+    unsigned seed = (unsigned)time(NULL);
+    trace_t *trace;
+    char c;
+    int i;
+
+    while ((c = getopt(argc, argv, "f:t:n:s:hv")) != EOF) {
+        switch (c) {
+        case 'f': /* Use this trace file (relative to curr dir), repeatable */
+	    if (num_tracefiles == MAXTRACES)
+		app_error("too many -f options");
+	    strcpy(tracedir, "./");
+	    tracefiles[num_tracefiles++] = optarg;
+	    tracefiles[num_tracefiles] = NULL;
+	    traces = tracefiles;
+            break;
+	case 't': /* Directory where the traces are located */
+	    if (num_tracefiles > 0) /* ignore if -f already encountered */
+		break;
+	    strcpy(tracedir, optarg);
+	    if (tracedir[strlen(tracedir)-1] != '/')
+		strcat(tracedir, "/"); /* path always ends with "/" */
+	    break;
+	case 'n': /* Number of timed rounds per trace */
+	    rounds = atoi(optarg);
+	    if (rounds < 2)
+		app_error("need at least 2 rounds");
+	    break;
+	case 's': /* Seed for the order of packages within a round */
+	    seed = atoi(optarg);
+	    break;
+        case 'v': /* Print every timed sample */
+            verbose = 1;
+            break;
+        case 'h': /* Print this message */
+	    usage();
+            exit(0);
+        default:
+	    usage();
+            exit(1);
+        }
+    }
+
+    if (argc - optind < 2) {
+	usage();
+	exit(1);
+    }
+    for (i = optind; i < argc; i++) {
+	if (npkgs == MAXPKGS)
+	    app_error("too many packages");
+	load_package(&pkgs[npkgs++], argv[i]);
+    }
+    for (i = 0; i < npkgs; i++)
+	if ((pkgs[i].secs = (double *)malloc(rounds * sizeof(double))) == NULL)
+	    app_error("malloc failed in main");
+
+    srand(seed);
+    mem_init();
+    printf("Baseline %s, %d rounds per trace (seed %u)\n",
+	   pkgs[0].path, rounds, seed);
+
+    for (i = 0; traces[i] != NULL; i++) {
+	trace = read_trace(tracedir, traces[i]);
+	compare(traces[i], trace, rounds);
+	free_trace(trace);
+    }
+
+    mem_deinit();
+    exit(0);
+}
+
+/*
+ * load_package - Load the malloc package in the shared library at path.
+ *     Each library gets a private symbol scope, so its mm_malloc and
+ *     friends never bind to another package's.
+ */
+static void load_package(package_t *p, char *path)
+{
+    char msg[MAXLINE];
+
+    p->path = path;
+    if ((p->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+	sprintf(msg, "Could not load %s: %s", path, dlerror());
+	app_error(msg);
+    }
+    p->init = (int (*)(void))load_symbol(p, "mm_init", 1);
+    p->malloc = (void *(*)(size_t))load_symbol(p, "mm_malloc", 1);
+    p->free = (void (*)(void *))load_symbol(p, "mm_free", 1);
+    p->realloc = (void *(*)(void *, size_t))load_symbol(p, "mm_realloc", 1);
+    p->free_sized = (void (*)(void *, size_t))
+	load_symbol(p, "mm_free_sized", 0);
+    p->malloc_batch = (size_t (*)(size_t, size_t, void **))
+	load_symbol(p, "mm_malloc_batch", 0);
+    p->free_batch = (void (*)(void **, size_t))
+	load_symbol(p, "mm_free_batch", 0);
+}
+
+/*
+ * load_symbol - Look up name in package p. Exits if a required
+ *     symbol is missing, else returns NULL for a missing one.
+ */
+static void *load_symbol(package_t *p, char *name, int required)
+{
+    char msg[MAXLINE];
+    void *sym = dlsym(p->handle, name);
+
+    if (sym == NULL && required) {
+	sprintf(msg, "%s does not define %s", p->path, name);
+	app_error(msg);
+    }
+    return sym;
+}
+
+/*
+ * replay - Run every request of the trace against package p on a fresh
+ *     heap. Returns 1 on success and 0 if any request failed.
+ */
+static int replay(package_t *p, trace_t *trace)
+{
+    traceop_t *op;
+    char **blocks = trace->blocks;
+    int i, k;
+
+    mem_reset_brk();
+    if (p->init() < 0)
+	return 0;
+
+    for (i = 0; i < trace->num_ops; i++) {
+	op = &trace->ops[i];
+	switch (op->type) {
+	case ALLOC:
+	    if ((blocks[op->index] = p->malloc(op->size)) == NULL)
+		return 0;
+	    trace->block_sizes[op->index] = op->size;
+	    break;
+
+	case REALLOC:
+	    if ((blocks[op->index] = p->realloc(blocks[op->index],
+						op->size)) == NULL)
+		return 0;
+	    trace->block_sizes[op->index] = op->size;
+	    break;
+
+	case FREE:
+	    p->free(blocks[op->index]);
+	    break;
+
+	case FREE_SIZED:
+	    if (p->free_sized)
+		p->free_sized(blocks[op->index],
+			      trace->block_sizes[op->index]);
+	    else
+		p->free(blocks[op->index]);
+	    break;
+
+	case ALLOC_BATCH:
+	    if (p->malloc_batch) {
+		if (p->malloc_batch(op->count, op->size,
+				    (void **)(blocks + op->index)) != op->count)
+		    return 0;
+	    } else {
+		for (k = op->index; k < op->index + op->count; k++)
+		    if ((blocks[k] = p->malloc(op->size)) == NULL)
+			return 0;
+	    }
+	    for (k = op->index; k < op->index + op->count; k++)
+		trace->block_sizes[k] = op->size;
+	    break;
+
+	case FREE_BATCH:
+	    if (p->free_batch) {
+		p->free_batch((void **)(blocks + op->index), op->count);
+	    } else {
+		for (k = op->index; k < op->index + op->count; k++)
+		    p->free(blocks[k]);
+	    }
+	    break;
+	}
+    }
+    return 1;
+}
+
+/*
+ * time_replay - Return the average time in seconds of reps replays
+ */
+static double time_replay(package_t *p, trace_t *trace, int reps)
+{
+    double start = now();
+    int i;
+
+    for (i = 0; i < reps; i++)
+	replay(p, trace);
+    return (now() - start) / reps;
+}
+
+/*
+ * compare - Time all packages on one trace and print the comparison
+ */
+static void compare(char *name, trace_t *trace, int rounds)
+{
+    int order[MAXPKGS];
+    sample_t base, s;
+    double p, df, speedup, se, t;
+    int reps, i, j, r, tmp;
+    char msg[MAXLINE];
+
+    /* Every package must be able to run the trace */
+    for (i = 0; i < npkgs; i++) {
+	if (!replay(&pkgs[i], trace)) {
+	    sprintf(msg, "%s failed on trace %s", pkgs[i].path, name);
+	    app_error(msg);
+	}
+    }
+
+    /* Short traces are replayed several times per sample */
+    for (reps = 1; time_replay(&pkgs[0], trace, reps) * reps < MIN_SAMPLE;
+	 reps *= 2)
+	;
+
+    /* One untimed warmup round, then interleaved timed rounds */
+    for (i = 0; i < npkgs; i++) {
+	order[i] = i;
+	time_replay(&pkgs[i], trace, reps);
+    }
+    for (r = 0; r < rounds; r++) {
+	for (i = npkgs - 1; i > 0; i--) {
+	    j = rand() % (i + 1);
+	    tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+	}
+	for (i = 0; i < npkgs; i++) {
+	    pkgs[order[i]].secs[r] = time_replay(&pkgs[order[i]], trace, reps);
+	    if (verbose)
+		printf("%s round %d %s %.3f us\n", name, r,
+		       pkgs[order[i]].path, pkgs[order[i]].secs[r] * 1e6);
+	}
+    }
+
+    printf("\nTrace %s (%d ops, %d replays per sample)\n",
+	   name, trace->num_reqs, reps);
+    printf("%-24s%12s%10s%9s%19s%10s\n",
+	   "package", "mean(us)", "sd(us)", "speedup", "95% CI", "p");
+    base = summarize(pkgs[0].secs, rounds);
+    printf("%-24s%12.3f%10.3f%9.3f%19s%10s\n", pkgs[0].path,
+	   base.mean * 1e6, sqrt(base.var) * 1e6, 1.0, "-", "-");
+
+    for (i = 1; i < npkgs; i++) {
+	s = summarize(pkgs[i].secs, rounds);
+	p = welch_p(base, s, &df);
+
+	/* Delta-method interval for the ratio of the two means */
+	speedup = base.mean / s.mean;
+	se = speedup * sqrt(base.var / (base.n * base.mean * base.mean) +
+			    s.var / (s.n * s.mean * s.mean));
+	t = t_quantile(ALPHA, df);
+
+	sprintf(msg, "[%.3f, %.3f]", speedup - t * se, speedup + t * se);
+	printf("%-24s%12.3f%10.3f%9.3f%19s%10.4f  %s\n", pkgs[i].path,
+	       s.mean * 1e6, sqrt(s.var) * 1e6, speedup, msg, p,
+	       (p >= ALPHA) ? "no significant difference" :
+	       (speedup > 1.0) ? "faster" : "slower");
+    }
+}
+
+/*
+ * summarize - Return the mean and variance of x[0..n-1]
+ */
+static sample_t summarize(double *x, int n)
+{
+    sample_t s;
+    double ss = 0;
+    int i;
+
+    s.n = n;
+    s.mean = 0;
+    for (i = 0; i < n; i++)
+	s.mean += x[i];
+    s.mean /= n;
+    for (i = 0; i < n; i++)
+	ss += (x[i] - s.mean) * (x[i] - s.mean);
+    s.var = ss / (n - 1);
+    return s;
+}
+
+/*
+ * welch_p - Two-sided p-value of Welch's t-test for equal means.
+ *     Stores the Welch-Satterthwaite degrees of freedom in *df.
+ */
+static double welch_p(sample_t a, sample_t b, double *df)
+{
+    double va = a.var / a.n, vb = b.var / b.n;
+    double t;
+
+    if (va + vb == 0) {
+	*df = a.n + b.n - 2;
+	return (a.mean == b.mean) ? 1.0 : 0.0;
+    }
+    t = (a.mean - b.mean) / sqrt(va + vb);
+    *df = (va + vb) * (va + vb) /
+	(va * va / (a.n - 1) + vb * vb / (b.n - 1));
+    return betai(*df / 2, 0.5, *df / (*df + t * t));
+}
+
+/*
+ * t_quantile - Return t such that a two-sided t-test with df degrees
+ *     of freedom has p-value p, by bisection on the p-value.
+ */
+static double t_quantile(double p, double df)
+{
+    double lo = 0, hi = 1000, mid;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+	mid = (lo + hi) / 2;
+	if (betai(df / 2, 0.5, df / (df + mid * mid)) > p)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return (lo + hi) / 2;
+}
+
+/*
+ * betai - Regularized incomplete beta function I_x(a, b)
+ */
+static double betai(double a, double b, double x)
+{
+    double bt;
+
+    if (x <= 0)
+	return 0;
+    if (x >= 1)
+	return 1;
+    bt = exp(lgamma(a + b) - lgamma(a) - lgamma(b) +
+	     a * log(x) + b * log(1 - x));
+    /* The continued fraction converges fastest on this side */
+    if (x < (a + 1) / (a + b + 2))
+	return bt * betacf(a, b, x) / a;
+    return 1 - bt * betacf(b, a, 1 - x) / b;
+}
+
+/*
+ * betacf - Continued fraction for betai, by the modified Lentz method
+ */
+static double betacf(double a, double b, double x)
+{
+    const double tiny = 1e-300, eps = 1e-12;
+    double c = 1, d, h, aa, del;
+    int m, m2;
+
+    d = 1 - (a + b) * x / (a + 1);
+    d = (fabs(d) < tiny) ? tiny : d;
+    d = 1 / d;
+    h = d;
+    for (m = 1; m <= 300; m++) {
+	m2 = 2 * m;
+	aa = m * (b - m) * x / ((a + m2 - 1) * (a + m2));
+	d = 1 + aa * d;
+	d = (fabs(d) < tiny) ? tiny : d;
+	c = 1 + aa / c;
+	c = (fabs(c) < tiny) ? tiny : c;
+	d = 1 / d;
+	h *= d * c;
+	aa = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1));
+	d = 1 + aa * d;
+	d = (fabs(d) < tiny) ? tiny : d;
+	c = 1 + aa / c;
+	c = (fabs(c) < tiny) ? tiny : c;
+	d = 1 / d;
+	del = d * c;
+	h *= del;
+	if (fabs(del - 1) < eps)
+	    break;
+    }
+    return h;
+}
+
+/*
+ * now - Return a monotonic time stamp in seconds
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mdab [-hv] [-n <rounds>] [-s <seed>] "
+	    "[-f <file>]... [-t <dir>] <base.so> <pkg.so>...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>    Use <file> as a trace file (repeatable).\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+    fprintf(stderr, "\t-n <rounds>  Timed rounds per trace (default %d).\n",
+	    ROUNDS);
+    fprintf(stderr, "\t-s <seed>    Seed for the order within a round.\n");
+    fprintf(stderr, "\t-t <dir>     Directory to find default traces.\n");
+    fprintf(stderr, "\t-v           Print every timed sample.\n");
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg)
+{
+    printf("%s\n", msg);
+    exit(1);
+}
@@ -20,6 +20,9 @@
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "mprof.h"
+#include "trace.h"
+#include "perfctr.h"
 
 /**********************
  * Constants and macros
@@ -44,24 +47,6 @@ typedef struct range_t {
     struct range_t *next;  /* next list element */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
-/* Holds the information for one trace file*/
-typedef struct {
-    int sugg_heapsize;   /* suggested heap size (unused) */
-    int num_ids;         /* number of alloc/realloc ids */
-    int num_ops;         /* number of distinct requests */
-    int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
-    char **blocks;       /* array of ptrs returned by malloc/realloc... */
-    size_t *block_sizes; /* ... and a corresponding array of payload sizes */
-} trace_t;
-
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
  * This struct is necessary because fcyc accepts only a pointer array
@@ -82,6 +67,9 @@ typedef struct {
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
 
+    /* defined only with -T */
+    double dtlb;     /* dTLB misses in one run of the trace */
+
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
@@ -89,6 +77,8 @@ typedef struct {
  * Global variables
  *******************/
 int verbose = 0;        /* global flag for verbose output */
+static int unbatch = 0; /* replay sized/batch requests one block at a time */
+static int count_tlb = 0; /* count dTLB misses while running the traces */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
@@ -111,9 +101,10 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
 
-/* These functions read, allocate, and free storage for traces */
-static trace_t *read_trace(char *tracedir, char *filename);
-static void free_trace(trace_t *trace);
+/* These functions issue the sized and batched requests to mm.c */
+static int batch_malloc(char **blocks, int count, int size);
+static void batch_free(char **blocks, int count);
+static void sized_free(char *p, size_t size);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -150,6 +141,7 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int page_mode = MEM_PAGES_BASE; /* Pages backing the heap (set by -H) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +150,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgaluP:H:T")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +176,25 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'u': /* Replay sized/batch requests as plain malloc/free */
+            unbatch = 1;
+            break;
+        case 'P': /* Sample a heap profile of mm.c every <rate> bytes */
+            mprof_init(atol(optarg), "mdriver");
+            break;
+        case 'H': /* Back the heap with huge pages */
+            if (!strcmp(optarg, "thp"))
+		page_mode = MEM_PAGES_THP;
+	    else if (!strcmp(optarg, "hugetlb"))
+		page_mode = MEM_PAGES_HUGETLB;
+	    else {
+		usage();
+		exit(1);
+	    }
+            break;
+        case 'T': /* Count dTLB misses */
+            count_tlb = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -238,6 +249,12 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /* Initialize the dTLB miss counters */
+    if (count_tlb && !perfctr_init()) {
+	printf("Warning: dTLB miss counters are not available here\n");
+	count_tlb = 0;
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package 
      */
@@ -253,7 +270,7 @@ int main(int argc, char **argv)
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
 	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
+	    libc_stats[i].ops = trace->num_reqs;
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
 	    libc_stats[i].valid = eval_libc_valid(trace, i);
@@ -262,6 +279,11 @@ int main(int argc, char **argv)
 		if (verbose > 1)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		if (count_tlb) {
+		    perfctr_start();
+		    eval_libc_speed(&speed_params);
+		    libc_stats[i].dtlb = perfctr_stop();
+		}
 	    }
 	    free_trace(trace);
 	}
@@ -285,12 +307,16 @@ int main(int argc, char **argv)
 	unix_error("mm_stats calloc in main failed");
     
     /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
+    if (mem_init_pages(page_mode) != page_mode)
+	printf("Warning: huge pages are not available, "
+	       "falling back to %s\n",
+	       (page_mode == MEM_PAGES_HUGETLB) ?
+	       "transparent huge pages or base pages" : "base pages");
 
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
 	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+	mm_stats[i].ops = trace->num_reqs;
 	if (verbose > 1)
 	    printf("Checking mm_malloc for correctness, ");
 	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
@@ -303,6 +329,11 @@ int main(int argc, char **argv)
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (count_tlb) {
+		perfctr_start();
+		eval_mm_speed(&speed_params);
+		mm_stats[i].dtlb = perfctr_stop();
+	    }
 	}
 	free_trace(trace);
     }
@@ -464,108 +495,6 @@ static void clear_ranges(range_t **ranges)
 }
 
 
-/**********************************************
- * The following routines manipulate tracefiles
- *********************************************/
-
-/*
- * read_trace - read a trace file and store it in memory
- */
-static trace_t *read_trace(char *tracedir, char *filename)
-{
-    FILE *tracefile;
-    trace_t *trace;
-    char type[MAXLINE];
-    char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
-
-    if (verbose > 1)
-	printf("Reading tracefile: %s\n", filename);
-
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-	unix_error("malloc 1 failed in read_trance");
-	
-    /* Read the trace file header */
-    strcpy(path, tracedir);
-    strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-	sprintf(msg, "Could not open %s in read_trace", path);
-	unix_error(msg);
-    }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
-    
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
-	}
-	op_index++;
-	
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-    
-    return trace;
-}
-
-/*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
- */
-void free_trace(trace_t *trace)
-{
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
-    free(trace->block_sizes);
-    free(trace);              /* and the trace record itself... */
-}
-
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
@@ -576,9 +505,10 @@ void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
 {
-    int i, j;
+    int i, j, k;
     int index;
     int size;
+    int count;
     int oldsize;
     char *newp;
     char *oldp;
@@ -598,6 +528,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     for (i = 0;  i < trace->num_ops;  i++) {
 	index = trace->ops[i].index;
 	size = trace->ops[i].size;
+	count = trace->ops[i].count;
 
         switch (trace->ops[i].type) {
 
@@ -674,6 +605,36 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    mm_free(p);
 	    break;
 
+        case FREE_SIZED: /* mm_free_sized */
+	    p = trace->blocks[index];
+	    remove_range(ranges, p);
+	    sized_free(p, trace->block_sizes[index]);
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+
+	    /* Call the student's batch malloc */
+	    if (!batch_malloc(trace->blocks + index, count, size)) {
+		malloc_error(tracenum, i, "mm_malloc_batch failed.");
+		return 0;
+	    }
+
+	    /* Check, fill, and remember every block of the batch */
+	    for (k = index; k < index + count; k++) {
+		p = trace->blocks[k];
+		if (add_range(ranges, p, size, tracenum, i) == 0)
+		    return 0;
+		memset(p, k & 0xFF, size);
+		trace->block_sizes[k] = size;
+	    }
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    for (k = index; k < index + count; k++)
+		remove_range(ranges, trace->blocks[k]);
+	    batch_free(trace->blocks + index, count);
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -697,9 +658,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 {   
-    int i;
+    int i, k;
     int index;
-    int size, newsize, oldsize;
+    int size, newsize, oldsize, count;
     int max_total_size = 0;
     int total_size = 0;
     char *p;
@@ -768,6 +729,36 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    break;
 
+        case FREE_SIZED: /* mm_free_sized */
+	    index = trace->ops[i].index;
+	    size = trace->block_sizes[index];
+	    sized_free(trace->blocks[index], size);
+	    total_size -= size;
+	    break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    count = trace->ops[i].count;
+
+	    if (!batch_malloc(trace->blocks + index, count, size))
+		app_error("mm_malloc_batch failed in eval_mm_util");
+	    for (k = index; k < index + count; k++)
+		trace->block_sizes[k] = size;
+
+	    total_size += count * size;
+	    max_total_size = (total_size > max_total_size) ?
+		total_size : max_total_size;
+	    break;
+
+        case FREE_BATCH: /* mm_free_batch */
+	    index = trace->ops[i].index;
+	    count = trace->ops[i].count;
+	    batch_free(trace->blocks + index, count);
+	    for (k = index; k < index + count; k++)
+		total_size -= trace->block_sizes[k];
+	    break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_util");
 
@@ -820,6 +811,23 @@ static void eval_mm_speed(void *ptr)
             mm_free(block);
             break;
 
+        case FREE_SIZED: /* mm_free_sized */
+            index = trace->ops[i].index;
+            sized_free(trace->blocks[index], trace->block_sizes[index]);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            if (!batch_malloc(trace->blocks + index, trace->ops[i].count,
+			      trace->ops[i].size))
+		app_error("mm_malloc_batch error in eval_mm_speed");
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            batch_free(trace->blocks + index, trace->ops[i].count);
+            break;
+
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -833,7 +841,7 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i, k, newsize;
     char *p, *newp, *oldp;
 
     for (i = 0;  i < trace->num_ops;  i++) {
@@ -858,9 +866,25 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    break;
 	    
         case FREE: /* free */
+        case FREE_SIZED:
 	    free(trace->blocks[trace->ops[i].index]);
 	    break;
 
+        case ALLOC_BATCH: /* one malloc per block */
+	    for (k = 0; k < trace->ops[i].count; k++) {
+		if ((p = malloc(trace->ops[i].size)) == NULL) {
+		    malloc_error(tracenum, i, "libc malloc failed");
+		    unix_error("System message");
+		}
+		trace->blocks[trace->ops[i].index + k] = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    for (k = 0; k < trace->ops[i].count; k++)
+		free(trace->blocks[trace->ops[i].index + k]);
+	    break;
+
 	default:
 	    app_error("invalid operation type  in eval_libc_valid");
 	}
@@ -876,7 +900,7 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, k;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
@@ -902,14 +926,81 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
+        case FREE_SIZED:
 	    index = trace->ops[i].index;
 	    block = trace->blocks[index];
 	    free(block);
 	    break;
+
+        case ALLOC_BATCH: /* one malloc per block */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    for (k = 0; k < trace->ops[i].count; k++) {
+		if ((p = malloc(size)) == NULL)
+		    unix_error("malloc failed in eval_libc_speed");
+		trace->blocks[index + k] = p;
+	    }
+	    break;
+
+        case FREE_BATCH: /* one free per block */
+	    index = trace->ops[i].index;
+	    for (k = 0; k < trace->ops[i].count; k++)
+		free(trace->blocks[index + k]);
+	    break;
 	}
     }
 }
 
+/*********************************************************************
+ * The following routines issue the sized and batched requests to the
+ * mm package, or, with -u, the equivalent sequence of plain mm_malloc
+ * and mm_free calls so the two paths can be compared on one trace.
+ *********************************************************************/
+
+/*
+ * batch_malloc - Allocate count blocks of size bytes into blocks[0..count-1].
+ *     Returns 1 on success and 0 if the allocator failed.
+ */
+static int batch_malloc(char **blocks, int count, int size)
+{
+    int k;
+
+    if (!unbatch)
+	return mm_malloc_batch(count, size, (void **)blocks) == count;
+
+    for (k = 0; k < count; k++)
+	if ((blocks[k] = mm_malloc(size)) == NULL)
+	    return 0;
+    return 1;
+}
+
+/*
+ * batch_free - Free the count blocks in blocks[0..count-1]
+ */
+static void batch_free(char **blocks, int count)
+{
+    int k;
+
+    if (!unbatch) {
+	mm_free_batch((void **)blocks, count);
+	return;
+    }
+
+    for (k = 0; k < count; k++)
+	mm_free(blocks[k]);
+}
+
+/*
+ * sized_free - Free block p whose payload size is known to be size
+ */
+static void sized_free(char *p, size_t size)
+{
+    if (unbatch)
+	mm_free(p);
+    else
+	mm_free_sized(p, size);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -924,50 +1015,67 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double dtlb = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
+    printf("%5s%7s %5s%8s%10s%6s", 
 	   "trace", " valid", "util", "ops", "secs", "Kops");
+    if (count_tlb)
+	printf("%10s", "dTLB");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (count_tlb)
+		printf("%10.0f", stats[i].dtlb);
+	    printf("\n");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    dtlb += stats[i].dtlb;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%10s%6s", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
 		   "-");
+	    if (count_tlb)
+		printf("%10s", "-");
+	    printf("\n");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%%8.0f%10.6f%6.0f", 
 	       "Total       ",
 	       (util/n)*100.0,
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
+	if (count_tlb)
+	    printf("%10.0f", dtlb);
+	printf("\n");
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%8s%10s%6s", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
 	       "-");
+	if (count_tlb)
+	    printf("%10s", "-");
+	printf("\n");
     }
 
 }
@@ -1004,14 +1112,18 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValuT] [-f <file>] [-t <dir>] [-P <rate>] [-H <pages>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H <pages> Back the heap with \"thp\" or \"hugetlb\" pages.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-P <rate>  Profile mm.c, sampling every <rate> bytes.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T         Count dTLB misses for each trace.\n");
+    fprintf(stderr, "\t-u         Replay sized/batch requests as malloc/free.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
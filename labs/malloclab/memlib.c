@@ -14,8 +14,12 @@
 #include "memlib.h"
 #include "config.h"
 
+/* Huge page size, which is also the alignment of a huge page heap */
+#define HUGE_PAGE (2*(1<<20))  /* 2 MB */
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
+static size_t mem_map_size;  /* size of the heap mapping, 0 if malloc'd */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
 
@@ -24,14 +28,75 @@ static char *mem_max_addr;   /* largest legal heap address */
  */
 void mem_init(void)
 {
+    mem_init_pages(MEM_PAGES_BASE);
+}
+
+/*
+ * mem_init_pages - initialize the memory system model, backing the heap
+ *    with the kind of pages given by mode. The heap start is aligned to
+ *    the huge page size for the huge page modes. If the requested pages
+ *    are not available, fall back from MEM_PAGES_HUGETLB to MEM_PAGES_THP
+ *    to MEM_PAGES_BASE. Returns the mode that was actually used.
+ */
+int mem_init_pages(int mode)
+{
+    size_t size = (MAX_HEAP + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    char *p;
+    size_t lead;
+
+    mem_map_size = 0;
+
+#ifdef MAP_HUGETLB
+    if (mode == MEM_PAGES_HUGETLB) {
+	/* Explicit huge pages come from the pool in /proc/sys/vm/nr_hugepages */
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+	    mem_start_brk = p;
+	    mem_map_size = size;
+	}
+	else
+	    mode = MEM_PAGES_THP;
+    }
+#else
+    if (mode == MEM_PAGES_HUGETLB)
+	mode = MEM_PAGES_THP;
+#endif
+
+#ifdef MADV_HUGEPAGE
+    if (mode == MEM_PAGES_THP) {
+	/* Over-allocate by a huge page, then trim to a 2 MB aligned range */
+	p = mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+	    mode = MEM_PAGES_BASE;
+	}
+	else {
+	    lead = (HUGE_PAGE - ((size_t)p & (HUGE_PAGE - 1))) & (HUGE_PAGE - 1);
+	    if (lead > 0)
+		munmap(p, lead);
+	    munmap(p + lead + size, HUGE_PAGE - lead);
+	    mem_start_brk = p + lead;
+	    mem_map_size = size;
+	    if (madvise(mem_start_brk, size, MADV_HUGEPAGE) < 0)
+		mode = MEM_PAGES_BASE; /* THP disabled; keep the mapping */
+	}
+    }
+#else
+    if (mode == MEM_PAGES_THP)
+	mode = MEM_PAGES_BASE;
+#endif
+
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    if (mem_map_size == 0 &&
+	(mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    return mode;
 }
 
 /* 
@@ -39,7 +104,10 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    if (mem_map_size > 0)
+	munmap(mem_start_brk, mem_map_size);
+    else
+	free(mem_start_brk);
 }
 
 /*
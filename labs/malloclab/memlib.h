@@ -1,6 +1,12 @@
 #include <unistd.h>
 
+/* How mem_init_pages backs the simulated heap */
+#define MEM_PAGES_BASE    0  /* malloc'd storage, the system's default pages */
+#define MEM_PAGES_THP     1  /* 2 MB aligned mapping, transparent huge pages */
+#define MEM_PAGES_HUGETLB 2  /* explicit MAP_HUGETLB huge pages */
+
 void mem_init(void);               
+int mem_init_pages(int mode);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
@@ -14,9 +14,11 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "mprof.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -49,6 +51,7 @@ team_t team = {
  */
 int mm_init(void)
 {
+    mprof_reset();
     return 0;
 }
 
@@ -64,7 +67,9 @@ void *mm_malloc(size_t size)
 	return NULL;
     else {
         *(size_t *)p = size;
-        return (void *)((char *)p + SIZE_T_SIZE);
+        p = (char *)p + SIZE_T_SIZE;
+        MPROF_MALLOC(p, size);
+        return p;
     }
 }
 
@@ -73,6 +78,7 @@ void *mm_malloc(size_t size)
  */
 void mm_free(void *ptr)
 {
+    MPROF_FREE(ptr);
 }
 
 /*
@@ -95,16 +101,51 @@ void *mm_realloc(void *ptr, size_t size)
     return newptr;
 }
 
+/*
+ * mm_free_sized - Free a block whose payload size the caller already
+ *     knows. The size is only a hint, so it must not exceed the size the
+ *     block was allocated with.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+    assert(size <= *(size_t *)((char *)ptr - SIZE_T_SIZE));
+    mm_free(ptr);
+}
 
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes each and store their
+ *     payload pointers in out[0..n-1]. The aligned block size is computed
+ *     and the brk pointer is moved once for the whole batch. Returns the
+ *     number of blocks allocated, which is either n or 0.
+ */
+size_t mm_malloc_batch(size_t n, size_t size, void **out)
+{
+    size_t newsize = ALIGN(size + SIZE_T_SIZE);
+    size_t i;
+    char *p;
+
+    if (n == 0)
+	return 0;
+    if (newsize > INT_MAX / n)
+	return 0;
+    p = mem_sbrk((int)(n * newsize));
+    if (p == (void *)-1)
+	return 0;
+    for (i = 0; i < n; i++, p += newsize) {
+	*(size_t *)p = size;
+	out[i] = (void *)(p + SIZE_T_SIZE);
+	MPROF_MALLOC(out[i], size);
+    }
+    return n;
+}
 
+/*
+ * mm_free_batch - Free the n blocks in ptrs[0..n-1].
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    size_t i;
 
-
-
-
-
-
-
-
-
-
-
+    for (i = 0; i < n; i++)
+	mm_free(ptrs[i]);
+}
@@ -5,6 +5,11 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/* Sized and batched entry points */
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_batch(size_t n, size_t size, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -0,0 +1,352 @@
+/*
+ * mprof.c - A sampling heap profiler for the malloc package
+ *
+ * The allocator calls MPROF_MALLOC and MPROF_FREE (see mprof.h) on
+ * every request. An allocation is sampled whenever the byte countdown
+ * mprof_bytes_left goes negative; the countdown is then reloaded with
+ * an exponentially distributed interval whose mean is the sampling
+ * rate, so the sample is not biased by periodic request patterns.
+ *
+ * For each sampled block we take a backtrace, find (or create) its
+ * allocation site in a small open-addressing hash table keyed by the
+ * stack, and remember the block in a second table keyed by address so
+ * that the free can be charged back to the same site.
+ *
+ * The profile is written in the legacy gperftools text format:
+ *
+ *   heap profile: <live n>: <live bytes> [<alloc n>: <alloc bytes>] @ heap_v2/<rate>
+ *   <live n>: <live bytes> [<alloc n>: <alloc bytes>] @ <pc> <pc> ...
+ *   ...
+ *   MAPPED_LIBRARIES:
+ *   <contents of /proc/self/maps>
+ *
+ * which "pprof <binary> <file>" unsamples and symbolizes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <execinfo.h>
+
+#include "mprof.h"
+
+#define MPROF_DEPTH  32        /* max frames recorded per site */
+#define MPROF_SKIP   2         /* frames of mprof_sample and mm_malloc */
+#define MPROF_SITES  (1<<12)   /* capacity of the site table */
+#define MPROF_LIVE   (1<<14)   /* capacity of the live sample table */
+
+/* Home slot of a block address in the live sample table */
+#define LIVE_HASH(p) ((unsigned)(((uintptr_t)(p) >> 3) * 2654435761U) % MPROF_LIVE)
+
+/* One allocation site, identified by its stack */
+typedef struct {
+    uintptr_t hash;        /* hash of pcs[], 0 if the slot is empty */
+    int depth;             /* number of valid entries in pcs[] */
+    void *pcs[MPROF_DEPTH];
+    long alloc_count;      /* sampled allocations from this site... */
+    long alloc_bytes;      /* ... and their total size */
+    long live_count;       /* sampled allocations not yet freed... */
+    long live_bytes;       /* ... and their total size */
+} site_t;
+
+/* One sampled block that is still allocated */
+typedef struct {
+    void *ptr;             /* payload address, NULL if the slot is empty */
+    size_t size;           /* requested size */
+    int site;              /* index into sites[] */
+} live_t;
+
+/* Public state read by the hooks in mprof.h */
+long mprof_bytes_left = LONG_MAX;
+int mprof_nlive = 0;
+
+/* Private state */
+static size_t rate;                /* mean sampling interval in bytes */
+static char prefix[256];           /* dump file name prefix */
+static int dump_seq = 0;           /* suffix of the next dump file */
+static site_t *sites;              /* site table */
+static live_t *live;               /* live sample table */
+static int nsites = 0;             /* number of used entries in sites[] */
+static long dropped = 0;           /* samples lost to full tables */
+static unsigned long long rng = 88172645463325252ULL; /* xorshift state */
+static volatile sig_atomic_t dump_requested = 0;
+static volatile long dump_bytes_left;  /* countdown the handler replaced */
+
+/* function prototypes */
+static long next_interval(void);
+static int find_site(void **pcs, int depth);
+static void live_insert(void *ptr, size_t size, int site);
+static void dump_handler(int sig);
+static void dump_at_exit(void);
+
+/*
+ * mprof_init - Start sampling one allocation every rate bytes on average.
+ *     Profiles go to <prefix>.0001.heap, <prefix>.0002.heap, ...
+ */
+void mprof_init(size_t r, const char *p)
+{
+    void *dummy[1];
+
+    rate = (r > 0) ? r : 1;
+    strncpy(prefix, p, sizeof(prefix) - 1);
+
+    sites = (site_t *)calloc(MPROF_SITES, sizeof(site_t));
+    live = (live_t *)calloc(MPROF_LIVE, sizeof(live_t));
+    if (sites == NULL || live == NULL) {
+	fprintf(stderr, "mprof_init: calloc error\n");
+	exit(1);
+    }
+
+    /* The first backtrace() call loads libgcc; do it outside the hooks */
+    backtrace(dummy, 1);
+
+    signal(MPROF_SIGNAL, dump_handler);
+    atexit(dump_at_exit);
+    mprof_bytes_left = next_interval();
+}
+
+/*
+ * mprof_reset - Forget all live samples. Called by mm_init after the
+ *     simulated heap has been reset, so no sampled block survives it.
+ */
+void mprof_reset(void)
+{
+    int i;
+
+    if (sites == NULL)
+	return;
+    for (i = 0; i < MPROF_SITES; i++) {
+	sites[i].live_count = 0;
+	sites[i].live_bytes = 0;
+    }
+    memset(live, 0, MPROF_LIVE * sizeof(live_t));
+    mprof_nlive = 0;
+}
+
+/*
+ * mprof_sample - Slow path of MPROF_MALLOC: the countdown expired, so
+ *     record the block of size bytes at ptr and reload the countdown,
+ *     then write the profile if MPROF_SIGNAL asked for it.
+ */
+void mprof_sample(void *ptr, size_t size)
+{
+    void *pcs[MPROF_DEPTH + MPROF_SKIP];
+    int depth, s;
+    long left = dump_bytes_left - (long)size;
+
+    /*
+     * If the handler forced this call, the countdown it replaced says
+     * whether the block is due anyway; if not, carry that countdown on.
+     */
+    if (dump_requested && mprof_bytes_left == -1 - (long)size && left >= 0)
+	mprof_bytes_left = left;
+    else {
+	mprof_bytes_left = next_interval();
+	if (ptr != NULL) {
+	    depth = backtrace(pcs, MPROF_DEPTH + MPROF_SKIP) - MPROF_SKIP;
+	    if (depth < 0)
+		depth = 0;
+	    if ((s = find_site(pcs + MPROF_SKIP, depth)) < 0)
+		dropped++;
+	    else {
+		sites[s].alloc_count++;
+		sites[s].alloc_bytes += size;
+		live_insert(ptr, size, s);
+	    }
+	}
+    }
+
+    /* A pending MPROF_SIGNAL is served here rather than in the handler,
+       after the sample so that it is in the dump */
+    if (dump_requested) {
+	dump_requested = 0;
+	mprof_dump();
+    }
+}
+
+/*
+ * mprof_free - Slow path of MPROF_FREE: if ptr is a sampled block,
+ *     charge its size back to its allocation site.
+ */
+void mprof_free(void *ptr)
+{
+    unsigned i, j, home;
+
+    i = LIVE_HASH(ptr);
+    while (live[i].ptr != ptr) {
+	if (live[i].ptr == NULL)
+	    return;              /* not a sampled block */
+	i = (i + 1) % MPROF_LIVE;
+    }
+
+    sites[live[i].site].live_count--;
+    sites[live[i].site].live_bytes -= live[i].size;
+    mprof_nlive--;
+
+    /* Backward-shift deletion keeps every probe sequence intact */
+    j = i;
+    for (;;) {
+	live[i].ptr = NULL;
+	for (;;) {
+	    j = (j + 1) % MPROF_LIVE;
+	    if (live[j].ptr == NULL)
+		return;
+	    home = LIVE_HASH(live[j].ptr);
+	    /* Stop at an entry whose home slot is not in (i, j] */
+	    if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j))
+		break;
+	}
+	live[i] = live[j];
+	i = j;
+    }
+}
+
+/*
+ * mprof_dump - Write the profile to the next <prefix>.NNNN.heap file
+ */
+void mprof_dump(void)
+{
+    char path[sizeof(prefix) + 32];
+    char buf[4096];
+    long live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    FILE *fp, *maps;
+    size_t n;
+    int i, k;
+
+    if (sites == NULL)
+	return;
+
+    sprintf(path, "%s.%04d.heap", prefix, ++dump_seq);
+    if ((fp = fopen(path, "w")) == NULL) {
+	perror("mprof_dump: fopen");
+	return;
+    }
+
+    for (i = 0; i < MPROF_SITES; i++) {
+	live_count += sites[i].live_count;
+	live_bytes += sites[i].live_bytes;
+	alloc_count += sites[i].alloc_count;
+	alloc_bytes += sites[i].alloc_bytes;
+    }
+    fprintf(fp, "heap profile: %ld: %ld [%ld: %ld] @ heap_v2/%lu\n",
+	    live_count, live_bytes, alloc_count, alloc_bytes,
+	    (unsigned long)rate);
+
+    for (i = 0; i < MPROF_SITES; i++) {
+	if (sites[i].hash == 0)
+	    continue;
+	fprintf(fp, "%ld: %ld [%ld: %ld] @",
+		sites[i].live_count, sites[i].live_bytes,
+		sites[i].alloc_count, sites[i].alloc_bytes);
+	for (k = 0; k < sites[i].depth; k++)
+	    fprintf(fp, " %p", sites[i].pcs[k]);
+	fprintf(fp, "\n");
+    }
+
+    /* pprof needs the mappings to symbolize the pcs */
+    fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+    if ((maps = fopen("/proc/self/maps", "r")) != NULL) {
+	while ((n = fread(buf, 1, sizeof(buf), maps)) > 0)
+	    fwrite(buf, 1, n, fp);
+	fclose(maps);
+    }
+    fclose(fp);
+
+    if (dropped > 0)
+	fprintf(stderr, "mprof: %ld samples dropped (tables full)\n", dropped);
+}
+
+/*
+ * next_interval - Draw the number of bytes until the next sample from
+ *     an exponential distribution with mean rate.
+ */
+static long next_interval(void)
+{
+    double u;
+
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    u = ((rng >> 11) + 1) * (1.0 / 9007199254740993.0); /* (0, 1) */
+    return (long)(-log(u) * rate) + 1;
+}
+
+/*
+ * find_site - Return the index of the site with the given stack,
+ *     creating it if needed, or -1 if the site table is full.
+ */
+static int find_site(void **pcs, int depth)
+{
+    uintptr_t h = 14695981039346656037ULL & UINTPTR_MAX;
+    unsigned i;
+    int k;
+
+    for (k = 0; k < depth; k++)
+	h = (h ^ (uintptr_t)pcs[k]) * 1099511628211ULL;
+    if (h == 0)
+	h = 1;
+
+    i = h % MPROF_SITES;
+    while (sites[i].hash != 0) {
+	if (sites[i].hash == h && sites[i].depth == depth &&
+	    memcmp(sites[i].pcs, pcs, depth * sizeof(void *)) == 0)
+	    return i;
+	i = (i + 1) % MPROF_SITES;
+    }
+
+    /* Keep the table at most 3/4 full so probes stay short */
+    if (4 * (nsites + 1) > 3 * MPROF_SITES)
+	return -1;
+    nsites++;
+    sites[i].hash = h;
+    sites[i].depth = depth;
+    memcpy(sites[i].pcs, pcs, depth * sizeof(void *));
+    return i;
+}
+
+/*
+ * live_insert - Remember that the sampled block at ptr belongs to site
+ */
+static void live_insert(void *ptr, size_t size, int site)
+{
+    unsigned i;
+
+    if (4 * (mprof_nlive + 1) > 3 * MPROF_LIVE) {
+	dropped++;
+	return;
+    }
+    sites[site].live_count++;
+    sites[site].live_bytes += size;
+
+    i = LIVE_HASH(ptr);
+    while (live[i].ptr != NULL)
+	i = (i + 1) % MPROF_LIVE;
+    live[i].ptr = ptr;
+    live[i].size = size;
+    live[i].site = site;
+    mprof_nlive++;
+}
+
+/*
+ * dump_handler - MPROF_SIGNAL handler. Writing the profile is not
+ *     async-signal-safe, so force the next allocation down the slow path
+ *     and let mprof_sample do it.
+ */
+static void dump_handler(int sig)
+{
+    if (!dump_requested)
+	dump_bytes_left = mprof_bytes_left;
+    dump_requested = 1;
+    mprof_bytes_left = -1;
+}
+
+/*
+ * dump_at_exit - Write a final profile when the program exits
+ */
+static void dump_at_exit(void)
+{
+    mprof_dump();
+}
@@ -0,0 +1,49 @@
+/*
+ * mprof.h - prototypes for the sampling heap profiler in mprof.c
+ *
+ * The profiler records a backtrace for roughly one allocation every
+ * "rate" bytes and keeps live-byte totals per allocation site. The
+ * profile is written in the legacy gperftools heap format understood
+ * by pprof, at exit and whenever the process receives MPROF_SIGNAL.
+ * Each sample costs a backtrace, so rates much below MPROF_RATE make
+ * the profiler noticeably slow down the traces it is measuring.
+ */
+#include <stddef.h>
+
+#define MPROF_SIGNAL SIGUSR1  /* dump the profile on this signal */
+#define MPROF_RATE   524288   /* suggested sampling rate in bytes */
+
+/* Bytes left until the next sample; only mprof.c should assign it */
+extern long mprof_bytes_left;
+
+/* Number of sampled blocks that have not been freed yet */
+extern int mprof_nlive;
+
+/* Start sampling every rate bytes, dumping to <prefix>.NNNN.heap */
+void mprof_init(size_t rate, const char *prefix);
+
+/* Forget all live samples (the heap was reset by mem_reset_brk) */
+void mprof_reset(void);
+
+/* Write the current profile to the next <prefix>.NNNN.heap file */
+void mprof_dump(void);
+
+/* Slow paths of the hooks below */
+void mprof_sample(void *ptr, size_t size);
+void mprof_free(void *ptr);
+
+/*
+ * The hooks the malloc package calls on every allocation and free.
+ * Unsampled calls cost one subtract-and-branch, or one load-and-branch.
+ */
+#define MPROF_MALLOC(ptr, size) \
+    do { \
+	if ((mprof_bytes_left -= (long)(size)) < 0) \
+	    mprof_sample((ptr), (size)); \
+    } while (0)
+
+#define MPROF_FREE(ptr) \
+    do { \
+	if (mprof_nlive > 0) \
+	    mprof_free(ptr); \
+    } while (0)
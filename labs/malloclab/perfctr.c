@@ -0,0 +1,95 @@
+/*
+ * perfctr.c - Count dTLB misses with the Linux perf_event_open interface
+ *
+ * We count load misses and, where the CPU can count them, store misses
+ * of the data TLB for the calling process in user mode. The counters
+ * are unavailable on non-Linux systems, in most virtual machines, and
+ * when /proc/sys/kernel/perf_event_paranoid forbids them.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "perfctr.h"
+
+/* private variables */
+static int load_fd = -1;   /* dTLB load miss counter */
+static int store_fd = -1;  /* dTLB store miss counter, if supported */
+
+#ifdef __linux__
+/*
+ * open_dtlb - Open a user-mode dTLB miss counter for op
+ */
+static int open_dtlb(int op)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+	(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/*
+ * perfctr_init - Open the counters; returns 1 if they work and 0 if not
+ */
+int perfctr_init(void)
+{
+#ifdef __linux__
+    load_fd = open_dtlb(PERF_COUNT_HW_CACHE_OP_READ);
+    if (load_fd >= 0)
+	store_fd = open_dtlb(PERF_COUNT_HW_CACHE_OP_WRITE);
+#endif
+    return load_fd >= 0;
+}
+
+/*
+ * perfctr_start - Reset and start the counters
+ */
+void perfctr_start(void)
+{
+#ifdef __linux__
+    if (load_fd >= 0) {
+	ioctl(load_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(load_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    if (store_fd >= 0) {
+	ioctl(store_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(store_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/*
+ * perfctr_stop - Stop the counters and return the dTLB misses counted
+ *     since perfctr_start, or -1 if the counters are unavailable
+ */
+long long perfctr_stop(void)
+{
+    long long loads = 0, stores = 0;
+
+    if (load_fd < 0)
+	return -1;
+#ifdef __linux__
+    ioctl(load_fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(load_fd, &loads, sizeof(loads)) != sizeof(loads))
+	return -1;
+    if (store_fd >= 0) {
+	ioctl(store_fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read(store_fd, &stores, sizeof(stores)) != sizeof(stores))
+	    stores = 0;
+    }
+#endif
+    return loads + stores;
+}
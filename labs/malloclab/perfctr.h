@@ -0,0 +1,10 @@
+/*
+ * perfctr.h - Count dTLB misses with the Linux perf_event_open interface
+ */
+
+/* Open the counters; returns 1 if they work here and 0 if not */
+int perfctr_init(void);
+
+/* Start counting, and return the dTLB misses since the last start */
+void perfctr_start(void);
+long long perfctr_stop(void);
@@ -0,0 +1,533 @@
+/*
+ * tracestat.c - Workload statistics for malloc lab trace files
+ *
+ * Reads each .rep trace in a single streaming pass (only per-id state
+ * is kept, never the request list) and reports:
+ *
+ *   - a histogram of request sizes (malloc, batch malloc and realloc)
+ *   - the distribution of block lifetimes, measured in trace requests
+ *   - live payload bytes over time and their peak
+ *   - realloc growth chains (reallocs per block and growth factors)
+ *   - the best utilization any allocator could reach, given only the
+ *     alignment and per-block header overhead
+ *   - size-class boundaries that cover a given share of the requests
+ *
+ * Usage: tracestat [-h] [-c <pct>] [-a <align>] [-o <bytes>] <tracefile>...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define MAXLINE   1024 /* max string size */
+#define NBUCKETS    48 /* log2 histogram buckets */
+#define NWINDOWS    20 /* number of windows in the live bytes timeline */
+#define BARWIDTH    40 /* width of the widest histogram bar */
+
+/* Rounds size up to a multiple of align (a power of two) */
+#define ALIGN_TO(size, align) (((size) + ((align)-1)) & ~((long)(align)-1))
+
+/******************************
+ * The key compound data types
+ *****************************/
+
+/* What we remember about each block id */
+typedef struct {
+    int live;        /* is the block currently allocated? */
+    long size;       /* current payload size */
+    long born;       /* request number of the malloc that created it */
+    int reallocs;    /* length of its realloc chain so far */
+} block_t;
+
+/* Number of requests of each distinct aligned size */
+typedef struct {
+    long size;
+    long count;
+} sizecount_t;
+
+/* Accumulated statistics for one trace */
+typedef struct {
+    long num_ops;                  /* requests in the trace header */
+    long allocs, frees, reallocs;  /* per-block request counts */
+    long size_hist[NBUCKETS];      /* request sizes, log2 buckets */
+    long life_hist[NBUCKETS];      /* lifetimes in requests, log2 buckets */
+    long never_freed;              /* blocks still live at the end */
+    long chain_hist[NBUCKETS];     /* reallocs per block, log2 buckets */
+    long grows, shrinks;           /* realloc steps by direction */
+    double growth_sum;             /* sum of new/old size over all steps */
+    long live_bytes, peak_bytes;   /* live payload now and at its peak */
+    long peak_op;                  /* request at which the peak happened */
+    long live_foot, peak_foot;     /* live footprint now and at its peak */
+    long window_peak[NWINDOWS];    /* peak live payload in each window */
+    int nwindows;                  /* windows used (fewer for tiny traces) */
+    int window;                    /* window of the last update */
+    sizecount_t *sizes;            /* open-addressing table of sizes */
+    int sizes_cap, sizes_len;
+} tstats_t;
+
+/********************
+ * Global variables
+ *******************/
+static double coverage = 90.0;     /* -c: share of requests to cover */
+static long align = ALIGNMENT;     /* -a: payload alignment */
+static long overhead = 0;          /* -o: header/footer bytes per block */
+
+/*********************
+ * Function prototypes
+ *********************/
+static void analyze(char *path);
+static void record_size(tstats_t *st, long size);
+static void block_alloc(tstats_t *st, block_t *b, long size, long op);
+static void block_free(tstats_t *st, block_t *b, long op);
+static void update_live(tstats_t *st, long op, long dpayload, long dfoot);
+static void print_report(char *path, tstats_t *st, int num_ids);
+static void print_hist(char *title, char *unit, long *hist);
+static void print_classes(tstats_t *st);
+static int bucket(long x);
+static int cmp_count(const void *a, const void *b);
+static int cmp_size(const void *a, const void *b);
+static void usage(void);
+static void app_error(char *msg);
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "hc:a:o:")) != EOF) {
+        switch (c) {
+	case 'c': /* Size classes must cover this percentage of requests */
+	    coverage = atof(optarg);
+	    break;
+	case 'a': /* Payload alignment of the ideal allocator */
+	    align = atol(optarg);
+	    if (align <= 0 || (align & (align - 1)))
+		app_error("alignment must be a power of two");
+	    break;
+	case 'o': /* Per-block overhead of the ideal allocator */
+	    overhead = atol(optarg);
+	    break;
+        case 'h':
+	    usage();
+            exit(0);
+        default:
+	    usage();
+            exit(1);
+        }
+    }
+    if (optind == argc) {
+	usage();
+	exit(1);
+    }
+
+    for (; optind < argc; optind++)
+	analyze(argv[optind]);
+    exit(0);
+}
+
+/*
+ * analyze - Stream one trace file and print its report
+ */
+static void analyze(char *path)
+{
+    FILE *fp;
+    tstats_t st;
+    block_t *blocks, *b;
+    char type[MAXLINE], msg[MAXLINE];
+    int sugg_heapsize, num_ids, num_ops, weight;
+    unsigned index, size, count, k;
+    long op;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s: %s", path, strerror(errno));
+	app_error(msg);
+    }
+    if (fscanf(fp, "%d %d %d %d", &sugg_heapsize, &num_ids,
+	       &num_ops, &weight) != 4) {
+	sprintf(msg, "Bad header in %s", path);
+	app_error(msg);
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.num_ops = num_ops;
+    st.nwindows = (num_ops < NWINDOWS) ? ((num_ops > 0) ? num_ops : 1) : NWINDOWS;
+    st.sizes_cap = 1024;
+    st.sizes = (sizecount_t *)calloc(st.sizes_cap, sizeof(sizecount_t));
+    blocks = (block_t *)calloc(num_ids, sizeof(block_t));
+    if (st.sizes == NULL || blocks == NULL)
+	app_error("calloc failed in analyze");
+
+    /* Interpret each request as it is read */
+    for (op = 0; fscanf(fp, "%s", type) != EOF; op++) {
+	count = 1;
+	size = 0;
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	    fscanf(fp, "%u %u", &index, &size);
+	    break;
+	case 'f':
+	case 's':
+	    fscanf(fp, "%u", &index);
+	    break;
+	case 'B':
+	    fscanf(fp, "%u %u %u", &index, &count, &size);
+	    break;
+	case 'F':
+	    fscanf(fp, "%u %u", &index, &count);
+	    break;
+	default:
+	    sprintf(msg, "Bogus type character (%c) in tracefile %s",
+		    type[0], path);
+	    app_error(msg);
+	}
+	if (index + count > (unsigned)num_ids) {
+	    sprintf(msg, "Block id %u out of range in %s", index + count - 1,
+		    path);
+	    app_error(msg);
+	}
+
+	for (k = index; k < index + count; k++) {
+	    b = &blocks[k];
+	    switch (type[0]) {
+	    case 'a':
+	    case 'B':
+		record_size(&st, size);
+		block_alloc(&st, b, size, op);
+		break;
+	    case 'f':
+	    case 's':
+	    case 'F':
+		block_free(&st, b, op);
+		break;
+	    case 'r':
+		record_size(&st, size);
+		st.reallocs++;
+		if (!b->live) {        /* realloc(NULL, size) */
+		    block_alloc(&st, b, size, op);
+		    break;
+		}
+		if ((long)size > b->size)
+		    st.grows++;
+		else if ((long)size < b->size)
+		    st.shrinks++;
+		if (b->size > 0)
+		    st.growth_sum += (double)size / b->size;
+		b->reallocs++;
+		update_live(&st, op, (long)size - b->size,
+			    ALIGN_TO(size + overhead, align) -
+			    ALIGN_TO(b->size + overhead, align));
+		b->size = size;
+		break;
+	    }
+	}
+    }
+    fclose(fp);
+    update_live(&st, st.num_ops, 0, 0);
+
+    /* Blocks that were never freed still end their realloc chains */
+    for (k = 0; k < (unsigned)num_ids; k++) {
+	if (blocks[k].live) {
+	    st.never_freed++;
+	    st.chain_hist[bucket(blocks[k].reallocs)]++;
+	}
+    }
+
+    print_report(path, &st, num_ids);
+    free(blocks);
+    free(st.sizes);
+}
+
+/*
+ * record_size - Count one request of size bytes in the size histogram
+ *     and in the table of distinct aligned sizes
+ */
+static void record_size(tstats_t *st, long size)
+{
+    sizecount_t *old;
+    long asize = ALIGN_TO(size, align);
+    int i, n;
+
+    st->size_hist[bucket(size)]++;
+
+    /* Grow the table when it is half full */
+    if (2 * (st->sizes_len + 1) > st->sizes_cap) {
+	old = st->sizes;
+	n = st->sizes_cap;
+	st->sizes_cap *= 2;
+	st->sizes = (sizecount_t *)calloc(st->sizes_cap, sizeof(sizecount_t));
+	if (st->sizes == NULL)
+	    app_error("calloc failed in record_size");
+	st->sizes_len = 0;
+	for (i = 0; i < n; i++) {
+	    if (old[i].count > 0) {
+		int j = (old[i].size / align) % st->sizes_cap;
+		while (st->sizes[j].count > 0)
+		    j = (j + 1) % st->sizes_cap;
+		st->sizes[j] = old[i];
+		st->sizes_len++;
+	    }
+	}
+	free(old);
+    }
+
+    i = (asize / align) % st->sizes_cap;
+    while (st->sizes[i].count > 0 && st->sizes[i].size != asize)
+	i = (i + 1) % st->sizes_cap;
+    if (st->sizes[i].count == 0) {
+	st->sizes[i].size = asize;
+	st->sizes_len++;
+    }
+    st->sizes[i].count++;
+}
+
+/*
+ * block_alloc - Block b of size bytes was allocated by request op
+ */
+static void block_alloc(tstats_t *st, block_t *b, long size, long op)
+{
+    st->allocs++;
+    b->live = 1;
+    b->size = size;
+    b->born = op;
+    b->reallocs = 0;
+    update_live(st, op, size, ALIGN_TO(size + overhead, align));
+}
+
+/*
+ * block_free - Block b was freed by request op
+ */
+static void block_free(tstats_t *st, block_t *b, long op)
+{
+    st->frees++;
+    st->life_hist[bucket(op - b->born)]++;
+    st->chain_hist[bucket(b->reallocs)]++;
+    update_live(st, op, -b->size, -ALIGN_TO(b->size + overhead, align));
+    b->live = 0;
+}
+
+/*
+ * update_live - Adjust the live payload and footprint at request op
+ */
+static void update_live(tstats_t *st, long op, long dpayload, long dfoot)
+{
+    int w = (st->num_ops > 0) ? op * st->nwindows / st->num_ops : 0;
+
+    if (w >= st->nwindows)
+	w = st->nwindows - 1;
+
+    /* Windows without updates hold the live bytes they started with */
+    while (st->window < w)
+	st->window_peak[++st->window] = st->live_bytes;
+
+    st->live_bytes += dpayload;
+    st->live_foot += dfoot;
+    if (st->live_bytes > st->peak_bytes) {
+	st->peak_bytes = st->live_bytes;
+	st->peak_op = op;
+    }
+    if (st->live_foot > st->peak_foot)
+	st->peak_foot = st->live_foot;
+    if (st->live_bytes > st->window_peak[w])
+	st->window_peak[w] = st->live_bytes;
+}
+
+/*
+ * print_report - Print all of the statistics for one trace
+ */
+static void print_report(char *path, tstats_t *st, int num_ids)
+{
+    long chained = st->grows + st->shrinks;
+    int w, len;
+
+    printf("Trace %s\n", path);
+    printf("  %ld requests, %d block ids: %ld allocs, %ld frees, "
+	   "%ld reallocs\n",
+	   st->num_ops, num_ids, st->allocs, st->frees, st->reallocs);
+
+    print_hist("Request sizes", "bytes", st->size_hist);
+    print_hist("Block lifetimes", "requests", st->life_hist);
+    if (st->never_freed > 0)
+	printf("  %ld blocks are never freed\n", st->never_freed);
+
+    printf("\nLive payload bytes (peak %ld at request %ld)\n",
+	   st->peak_bytes, st->peak_op);
+    printf("%12s %12s\n", "requests", "peak bytes");
+    for (w = 0; w < st->nwindows; w++) {
+	len = (st->peak_bytes > 0) ?
+	    st->window_peak[w] * BARWIDTH / st->peak_bytes : 0;
+	printf("%5ld-%-6ld %12ld %.*s\n",
+	       w * st->num_ops / st->nwindows,
+	       (w + 1) * st->num_ops / st->nwindows,
+	       st->window_peak[w], len,
+	       "########################################");
+    }
+
+    if (st->reallocs > 0) {
+	print_hist("Realloc chain lengths", "reallocs", st->chain_hist);
+	printf("  %ld grow, %ld shrink, mean growth factor %.2f\n",
+	       st->grows, st->shrinks,
+	       (chained > 0) ? st->growth_sum / chained : 1.0);
+    }
+
+    printf("\nBest utilization (align %ld, %ld bytes overhead): "
+	   "%ld / %ld = %.1f%%\n",
+	   align, overhead, st->peak_bytes, st->peak_foot,
+	   (st->peak_foot > 0) ? 100.0 * st->peak_bytes / st->peak_foot : 0.0);
+
+    print_classes(st);
+    printf("\n");
+}
+
+/*
+ * print_hist - Print a log2 histogram, one line per nonempty bucket
+ */
+static void print_hist(char *title, char *unit, long *hist)
+{
+    long total = 0, cum = 0, max = 0;
+    int i, lo, hi, len;
+
+    for (i = 0; i < NBUCKETS; i++) {
+	total += hist[i];
+	max = (hist[i] > max) ? hist[i] : max;
+    }
+    for (lo = 0; lo < NBUCKETS && hist[lo] == 0; lo++)
+	;
+    for (hi = NBUCKETS - 1; hi > lo && hist[hi] == 0; hi--)
+	;
+
+    printf("\n%s\n", title);
+    printf("%22s %10s %7s %7s\n", unit, "count", "pct", "cum");
+    for (i = lo; i <= hi && total > 0; i++) {
+	cum += hist[i];
+	len = hist[i] * BARWIDTH / max;
+	if (i == 0)
+	    printf("%22s", "0");
+	else
+	    printf("%10ld - %-9ld", (1L << (i - 1)), (1L << i) - 1);
+	printf(" %10ld %6.1f%% %6.1f%% %.*s\n", hist[i],
+	       100.0 * hist[i] / total, 100.0 * cum / total, len,
+	       "########################################");
+    }
+}
+
+/*
+ * print_classes - Suggest size classes: the fewest distinct aligned
+ *     sizes that together cover the requested share of all requests,
+ *     and the internal fragmentation of rounding the rest up to them.
+ */
+static void print_classes(tstats_t *st)
+{
+    sizecount_t *v;
+    long total = 0, cum = 0, waste = 0, large = 0, bytes = 0;
+    int i, j, n = 0, nclasses;
+
+    if ((v = (sizecount_t *)malloc((st->sizes_len + 1) *
+				   sizeof(sizecount_t))) == NULL)
+	app_error("malloc failed in print_classes");
+    for (i = 0; i < st->sizes_cap; i++) {
+	if (st->sizes[i].count > 0) {
+	    v[n++] = st->sizes[i];
+	    total += st->sizes[i].count;
+	}
+    }
+    if (total == 0) {
+	free(v);
+	return;
+    }
+
+    /* Most frequent sizes first, until the coverage target is met */
+    qsort(v, n, sizeof(sizecount_t), cmp_count);
+    for (nclasses = 0; nclasses < n && 100.0 * cum < coverage * total;
+	 nclasses++)
+	cum += v[nclasses].count;
+
+    /* Round every request up to the smallest class that holds it */
+    qsort(v, nclasses, sizeof(sizecount_t), cmp_size);
+    for (i = nclasses; i < n; i++) {
+	for (j = 0; j < nclasses && v[j].size < v[i].size; j++)
+	    ;
+	if (j == nclasses) {
+	    large += v[i].count;
+	} else {
+	    waste += (v[j].size - v[i].size) * v[i].count;
+	    bytes += v[j].size * v[i].count;
+	}
+    }
+    for (i = 0; i < nclasses; i++)
+	bytes += v[i].size * v[i].count;
+
+    printf("\nSize classes covering %.1f%% of requests (%d of %d sizes):\n",
+	   100.0 * cum / total, nclasses, n);
+    printf(" ");
+    for (i = 0; i < nclasses; i++)
+	printf(" %ld", v[i].size);
+    printf("\n  rounding waste %ld bytes (%.1f%%), %ld requests "
+	   "larger than the largest class\n",
+	   waste, (bytes > 0) ? 100.0 * waste / bytes : 0.0, large);
+    free(v);
+}
+
+/*
+ * bucket - Return the log2 bucket of x: 0 for 0, else 1 + floor(log2 x)
+ */
+static int bucket(long x)
+{
+    int b = 0;
+
+    while (x > 0 && b < NBUCKETS - 1) {
+	x >>= 1;
+	b++;
+    }
+    return b;
+}
+
+/*
+ * cmp_count, cmp_size - qsort comparators for sizecount_t
+ */
+static int cmp_count(const void *a, const void *b)
+{
+    long x = ((sizecount_t *)a)->count, y = ((sizecount_t *)b)->count;
+    return (x < y) - (x > y);
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+    long x = ((sizecount_t *)a)->size, y = ((sizecount_t *)b)->size;
+    return (x > y) - (x < y);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracestat [-h] [-c <pct>] [-a <align>] "
+	    "[-o <bytes>] <tracefile>...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <align>  Payload alignment (default %d).\n",
+	    ALIGNMENT);
+    fprintf(stderr, "\t-c <pct>    Size classes cover <pct>%% of requests "
+	    "(default 90).\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "\t-o <bytes>  Per-block header/footer overhead "
+	    "(default 0).\n");
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg)
+{
+    printf("%s\n", msg);
+    exit(1);
+}